@@ -0,0 +1,97 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Adaptive polling modeled on QEMU's AioContext poll_ns. Before blocking, the
+ * engine polls for events without blocking for up to poll_ns nanoseconds. The
+ * polling time grows while events arrive within poll_max_ns and is reset when
+ * waiting takes longer than that, so idle engines stop burning CPU.
+ */
+#include "fdmonbench.h"
+
+/* Polling starts at this many nanoseconds and doubles from there */
+#define ADAPTIVE_POLL_INITIAL_NS 4000
+
+void adaptive_poll_init(struct adaptive_poll *ap, int64_t poll_max_ns)
+{
+    *ap = (struct adaptive_poll){
+        .poll_max_ns = poll_max_ns,
+    };
+}
+
+static void adaptive_poll_adjust(struct adaptive_poll *ap, int64_t block_ns)
+{
+    if (block_ns <= ap->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ap->poll_max_ns) {
+        /* We'd have to poll for too long, stop polling */
+        ap->poll_ns = 0;
+    } else if (ap->poll_ns < ap->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        if (ap->poll_ns) {
+            ap->poll_ns *= 2;
+        } else {
+            ap->poll_ns = ADAPTIVE_POLL_INITIAL_NS;
+        }
+
+        if (ap->poll_ns > ap->poll_max_ns) {
+            ap->poll_ns = ap->poll_max_ns;
+        }
+    }
+}
+
+/*
+ * Wait for events using wait_fn(opaque, blocking), which returns the number of
+ * ready events or a negative value on error. Polls with blocking=false for up
+ * to poll_ns before calling wait_fn() with blocking=true.
+ */
+int adaptive_poll_wait(struct adaptive_poll *ap,
+                       int (*wait_fn)(void *opaque, bool blocking),
+                       void *opaque)
+{
+    int64_t start;
+    int ret;
+
+    if (ap->poll_max_ns == 0) {
+        return wait_fn(opaque, true);
+    }
+
+    start = get_ns();
+
+    if (ap->poll_ns > 0) {
+        do {
+            ret = wait_fn(opaque, false);
+            if (ret > 0) {
+                ap->poll_hits++;
+                goto out;
+            }
+
+            /* Errors are passed through without affecting the statistics */
+            if (ret < 0) {
+                return ret;
+            }
+        } while (get_ns() - start < ap->poll_ns);
+
+        ap->poll_misses++;
+    }
+
+    ret = wait_fn(opaque, true);
+
+out:
+    adaptive_poll_adjust(ap, get_ns() - start);
+    return ret;
+}
+
+/* CSV columns appended to an engine's print_stats() output */
+void adaptive_poll_print_header(const struct adaptive_poll *ap)
+{
+    if (ap->poll_max_ns) {
+        printf(",Poll hits,Poll misses,Poll ns");
+    }
+}
+
+void adaptive_poll_print_stats(const struct adaptive_poll *ap)
+{
+    if (ap->poll_max_ns) {
+        printf(",%lu,%lu,%lld", ap->poll_hits, ap->poll_misses,
+               (long long)ap->poll_ns);
+    }
+}
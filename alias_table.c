@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Walker's alias method for sampling a discrete distribution in O(1), built
+ * with Vose's O(n) algorithm.
+ */
+#include "fdmonbench.h"
+
+/* Probabilities are fixed point fractions of 2^31, the range of random_r() */
+#define ALIAS_TABLE_ONE (1u << 31)
+
+/* Returns false if out of memory or if the weights do not sum to > 0 */
+bool alias_table_init(struct alias_table *at, const double *weights, int n)
+{
+    double *scaled;
+    int *small;
+    int *large;
+    int num_small = 0;
+    int num_large = 0;
+    double sum = 0;
+    bool ret = false;
+
+    for (int i = 0; i < n; i++) {
+        sum += weights[i];
+    }
+    if (!(sum > 0)) {
+        return false;
+    }
+
+    at->n = n;
+    at->prob = calloc(n, sizeof(at->prob[0]));
+    at->alias = calloc(n, sizeof(at->alias[0]));
+    scaled = calloc(n, sizeof(scaled[0]));
+    small = calloc(n, sizeof(small[0]));
+    large = calloc(n, sizeof(large[0]));
+    if (!at->prob || !at->alias || !scaled || !small || !large) {
+        goto out;
+    }
+
+    /* Scale so that the average weight is 1 */
+    for (int i = 0; i < n; i++) {
+        scaled[i] = weights[i] * n / sum;
+        if (scaled[i] < 1) {
+            small[num_small++] = i;
+        } else {
+            large[num_large++] = i;
+        }
+    }
+
+    /* Fill each small column up to 1 with a slice of a large one */
+    while (num_small > 0 && num_large > 0) {
+        int s = small[--num_small];
+        int l = large[--num_large];
+
+        at->prob[s] = scaled[s] * ALIAS_TABLE_ONE;
+        at->alias[s] = l;
+
+        scaled[l] += scaled[s] - 1;
+        if (scaled[l] < 1) {
+            small[num_small++] = l;
+        } else {
+            large[num_large++] = l;
+        }
+    }
+
+    /* What is left is 1 up to rounding errors */
+    while (num_large > 0) {
+        at->prob[large[--num_large]] = ALIAS_TABLE_ONE;
+    }
+    while (num_small > 0) {
+        at->prob[small[--num_small]] = ALIAS_TABLE_ONE;
+    }
+
+    ret = true;
+
+out:
+    free(large);
+    free(small);
+    free(scaled);
+    if (!ret) {
+        alias_table_destroy(at);
+    }
+    return ret;
+}
+
+void alias_table_destroy(struct alias_table *at)
+{
+    free(at->prob);
+    free(at->alias);
+    at->prob = NULL;
+    at->alias = NULL;
+}
@@ -1,8 +1,12 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 #include <pthread.h>
+#include <linux/futex.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "fdmonbench.h"
 
 struct epoll_engine {
@@ -13,13 +17,78 @@ struct epoll_engine {
     sem_t startup_semaphore;
     int efd; /* the eventfd */
     int epfd; /* the epoll fd */
+    bool edge_triggered; /* are we using EPOLLET? */
+    bool oneshot; /* are we using EPOLLONESHOT on a shared epoll fd? */
+    bool exclusive; /* are we using EPOLLEXCLUSIVE? */
+    bool leader_follower; /* do threads take turns waiting on the epoll fd? */
+    atomic_int *leader_futex; /* held by the leader, see epoll_lf_lock() */
+    struct epoll_event *events;
+    int max_events;
+    uint32_t fd_events; /* epoll_event.events for monitored fds */
+
+    /* Number of events returned by each epoll_wait() */
+    struct histogram events_per_wait;
+
+    struct adaptive_poll adaptive_poll;
+
+    /* Number of times a follower slept waiting to become the leader */
+    unsigned long num_futex_waits;
+
+    struct engine_stats stats;
 };
 
+/*
+ * Leader/follower threads share one epoll set and only the leader waits on
+ * it. The leader hands off to the next follower as soon as epoll_wait()
+ * returns and then processes its events, so waiting and processing overlap.
+ *
+ * Promotion uses a futex mutex (mutex2 from Ulrich Drepper's "Futexes Are
+ * Tricky"): 0 is unlocked, 1 is locked, and 2 is locked with waiters.
+ */
+static void epoll_lf_lock(struct epoll_engine *pe)
+{
+    atomic_int *futex = pe->leader_futex;
+    int c = 0;
+
+    if (atomic_compare_exchange_strong(futex, &c, 1)) {
+        return;
+    }
+
+    if (c != 2) {
+        c = atomic_exchange(futex, 2);
+    }
+    while (c != 0) {
+        /* EAGAIN means the futex changed before we could sleep */
+        if (syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, 2,
+                    NULL, NULL, 0) == 0) {
+            pe->num_futex_waits++;
+        }
+        c = atomic_exchange(futex, 2);
+    }
+}
+
+/* Promote a follower */
+static void epoll_lf_unlock(struct epoll_engine *pe)
+{
+    atomic_int *futex = pe->leader_futex;
+
+    if (atomic_fetch_sub(futex, 1) != 1) {
+        atomic_store(futex, 0);
+        syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static int epoll_wait_events(void *opaque, bool blocking)
+{
+    struct epoll_engine *pe = opaque;
+
+    return epoll_wait(pe->epfd, pe->events, pe->max_events, blocking ? -1 : 0);
+}
+
 static void *epoll_thread(void *opaque)
 {
-    const size_t maxevents = 2; /* we only expect 1 fd and maybe the eventfd */
     struct epoll_engine *pe = opaque;
-    struct epoll_event events[maxevents];
+    struct epoll_event *events = pe->events;
 
     /* Ready! */
     sem_post(&pe->startup_semaphore);
@@ -27,7 +96,22 @@ static void *epoll_thread(void *opaque)
     for (;;) {
         int ret;
 
-        ret = epoll_wait(pe->epfd, events, maxevents, -1);
+        if (pe->leader_follower) {
+            epoll_lf_lock(pe);
+        }
+
+        ret = adaptive_poll_wait(&pe->adaptive_poll, epoll_wait_events, pe);
+
+        if (pe->leader_follower) {
+            epoll_lf_unlock(pe);
+        }
+
+        if (ret >= 0) {
+            histogram_add(&pe->events_per_wait, ret);
+        }
+        if (ret > 0) {
+            pe->stats.wakeups++;
+        }
 
         for (int i = 0; i < ret; i++) {
             int fd = events[i].data.fd;
@@ -36,6 +120,11 @@ static void *epoll_thread(void *opaque)
             if (fd == pe->efd) {
                 uint64_t eventfd_val;
 
+                /* Leave the shared eventfd readable to stop all threads */
+                if (pe->oneshot) {
+                    return NULL;
+                }
+
                 if (read(fd, &eventfd_val, sizeof(eventfd_val)) != sizeof(eventfd_val)) {
                     continue;
                 }
@@ -44,18 +133,107 @@ static void *epoll_thread(void *opaque)
                 return NULL;
             }
 
-            if (read(fd, pe->msgbuf, pe->msg_size) <= 0) {
-                continue;
+            pe->stats.events++;
+
+            if (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) <= 0) {
+                pe->stats.spurious++;
+            } else if (pe->edge_triggered) {
+                /*
+                 * No further events are reported until the fd has been
+                 * drained, so echo everything that has been queued.
+                 */
+                while (engine_echo(&pe->stats, fd, pe->msgbuf,
+                                   pe->msg_size) > 0) {
+                    /* nothing */
+                }
+            }
+
+            /* Re-arm the fd now that it has been serviced */
+            if (pe->oneshot) {
+                struct epoll_event event = {
+                    .events = EPOLLIN | EPOLLONESHOT,
+                    .data.fd = fd,
+                };
+
+                epoll_ctl(pe->epfd, EPOLL_CTL_MOD, fd, &event);
             }
-            write(fd, pe->msgbuf, pe->msg_size);
         }
     }
 
     return NULL;
 }
 
+/*
+ * EPOLLONESHOT and leader/follower engine instances share one epoll set so
+ * that each event is delivered to exactly one thread. Engines are created and
+ * destroyed by the main thread so no locking is needed.
+ */
+static struct {
+    int epfd;
+    int efd;
+    int refcount;
+    atomic_int leader_futex;
+} epoll_shared;
+
+/* Create the epoll fd and the eventfd used to tell the thread to stop */
+static const char *epoll_get_epfd(struct epoll_engine *pe)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+    };
+
+    pe->leader_futex = &epoll_shared.leader_futex;
+
+    if (pe->oneshot && epoll_shared.refcount > 0) {
+        pe->epfd = epoll_shared.epfd;
+        pe->efd = epoll_shared.efd;
+        epoll_shared.refcount++;
+        return NULL;
+    }
+
+    pe->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pe->epfd < 0) {
+        return "epoll_create1 failed";
+    }
+
+    pe->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pe->efd < 0) {
+        close(pe->epfd);
+        return "Eventfd creation failed";
+    }
+
+    if (pe->exclusive) {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    event.data.fd = pe->efd;
+
+    if (epoll_ctl(pe->epfd, EPOLL_CTL_ADD, pe->efd, &event) < 0) {
+        close(pe->efd);
+        close(pe->epfd);
+        return "epoll_ctl failed";
+    }
+
+    if (pe->oneshot) {
+        epoll_shared.epfd = pe->epfd;
+        epoll_shared.efd = pe->efd;
+        epoll_shared.refcount = 1;
+    }
+    return NULL;
+}
+
+static void epoll_put_epfd(struct epoll_engine *pe)
+{
+    if (pe->oneshot && --epoll_shared.refcount > 0) {
+        return;
+    }
+
+    close(pe->efd);
+    close(pe->epfd);
+}
+
 static struct engine *epoll_do_create(const struct options *opts,
                                       int *fds,
+                                      int num_fds,
                                       char **errmsg)
 {
     const char *err = NULL;
@@ -72,7 +250,16 @@ static struct engine *epoll_do_create(const struct options *opts,
         return NULL;
     }
 
-    pe->engine.ops = &epoll_engine_ops;
+    pe->engine.ops = opts->engine_ops;
+    pe->edge_triggered = opts->engine_ops == &epoll_et_engine_ops;
+    pe->leader_follower = opts->engine_ops == &epoll_lf_engine_ops;
+    pe->oneshot = opts->engine_ops == &epoll_oneshot_engine_ops ||
+                  pe->leader_follower;
+    pe->exclusive = opts->exclusive;
+    pe->num_futex_waits = 0;
+    memset(&pe->stats, 0, sizeof(pe->stats));
+    histogram_init(&pe->events_per_wait);
+    adaptive_poll_init(&pe->adaptive_poll, opts->poll_max_ns);
 
     pe->msg_size = opts->msg_size;
     pe->msgbuf = calloc(1, opts->msg_size);
@@ -81,41 +268,42 @@ static struct engine *epoll_do_create(const struct options *opts,
         goto err_free_se;
     }
 
-    pe->epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (pe->epfd < 0) {
-        err = "epoll_create1 failed";
+    pe->max_events = opts->max_events;
+    pe->events = malloc(sizeof(pe->events[0]) * pe->max_events);
+    if (!pe->events) {
+        err = "Out of memory";
         goto err_free_msgbuf;
     }
 
-    for (int i = 0; i < opts->num_fds; i++) {
-        event.data.fd = fds[i],
-
-        ret = epoll_ctl(pe->epfd, EPOLL_CTL_ADD, fds[i], &event);
-        if (ret < 0) {
-            err = "epoll_ctl failed";
-            goto err_close_epfd;
-        }
+    err = epoll_get_epfd(pe);
+    if (err) {
+        goto err_free_events;
     }
 
-    /* The eventfd is used to tell the thread to stop */
-    pe->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (pe->efd < 0) {
-        err = "Eventfd creation failed";
-        goto err_close_epfd;
+    if (pe->edge_triggered) {
+        event.events |= EPOLLET;
     }
+    if (pe->oneshot) {
+        event.events |= EPOLLONESHOT;
+    }
+    pe->fd_events = event.events;
 
-    event.data.fd = pe->efd;
+    for (int i = 0; i < num_fds; i++) {
+        event.data.fd = fds[i],
 
-    ret = epoll_ctl(pe->epfd, EPOLL_CTL_ADD, pe->efd, &event);
-    if (ret < 0) {
-        err = "epoll_ctl failed";
-        goto err_close_eventfd;
+        ret = epoll_ctl(pe->epfd, EPOLL_CTL_ADD, fds[i], &event);
+
+        /* Another instance may have added the fd to the shared epoll set */
+        if (ret < 0 && !(pe->oneshot && errno == EEXIST)) {
+            err = "epoll_ctl failed";
+            goto err_put_epfd;
+        }
     }
 
     /* The semaphore is used to wait for the thread to become ready */
     if (sem_init(&pe->startup_semaphore, 0, 0) < 0) {
         err = "Failed to create startup semaphore";
-        goto err_close_eventfd;
+        goto err_put_epfd;
     }
 
     /* Start thread */
@@ -140,10 +328,10 @@ err_pthread_join:
     pthread_join(pe->thread, NULL);
 err_sem_destroy:
     sem_destroy(&pe->startup_semaphore);
-err_close_eventfd:
-    close(pe->efd);
-err_close_epfd:
-    close(pe->epfd);
+err_put_epfd:
+    epoll_put_epfd(pe);
+err_free_events:
+    free(pe->events);
 err_free_msgbuf:
     free(pe->msgbuf);
 err_free_se:
@@ -162,15 +350,114 @@ static void epoll_destroy(struct engine *e)
 
     sem_destroy(&pe->startup_semaphore);
 
-    close(pe->efd);
-    close(pe->epfd);
+    epoll_put_epfd(pe);
+    free(pe->events);
     free(pe->msgbuf);
     free(pe);
 }
 
+static bool epoll_add_fd(struct engine *e, int fd)
+{
+    struct epoll_engine *pe = (struct epoll_engine *)e;
+    struct epoll_event event = {
+        .events = pe->fd_events,
+        .data.fd = fd,
+    };
+
+    /* Another instance may have added the fd to the shared epoll set */
+    return epoll_ctl(pe->epfd, EPOLL_CTL_ADD, fd, &event) == 0 ||
+           (pe->oneshot && errno == EEXIST);
+}
+
+static bool epoll_remove_fd(struct engine *e, int fd)
+{
+    struct epoll_engine *pe = (struct epoll_engine *)e;
+
+    /* Another instance may have removed the fd from the shared epoll set */
+    return epoll_ctl(pe->epfd, EPOLL_CTL_DEL, fd, NULL) == 0 ||
+           (pe->oneshot && errno == ENOENT);
+}
+
+static void epoll_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct epoll_engine *pe = (struct epoll_engine *)e;
+
+    *stats = pe->stats;
+}
+
+static void epoll_print_stats(struct engine *e,
+                              int index,
+                              __attribute__((unused)) unsigned long num_ios)
+{
+    struct epoll_engine *pe = (struct epoll_engine *)e;
+    struct histogram *h = &pe->events_per_wait;
+
+    if (index == 0) {
+        printf("Engine,Waits,Events/wait,Events/wait p50,Events/wait p99,Events/wait max");
+        if (pe->leader_follower) {
+            printf(",Futex waits");
+        }
+        adaptive_poll_print_header(&pe->adaptive_poll);
+        printf("\n");
+    }
+    printf("%d,%lu,%g,%lu,%lu,%lu", index, (unsigned long)h->total,
+           histogram_mean(h),
+           (unsigned long)histogram_percentile(h, 50),
+           (unsigned long)histogram_percentile(h, 99),
+           (unsigned long)h->max);
+    if (pe->leader_follower) {
+        printf(",%lu", pe->num_futex_waits);
+    }
+    adaptive_poll_print_stats(&pe->adaptive_poll);
+    printf("\n");
+}
+
 const struct engine_ops epoll_engine_ops = {
     .name = "epoll",
     .create = epoll_do_create,
     .destroy = epoll_destroy,
+    .print_stats = epoll_print_stats,
+    .get_stats = epoll_get_stats,
+    .add_fd = epoll_add_fd,
+    .remove_fd = epoll_remove_fd,
+    .supports_adaptive_polling = true,
+    .supports_max_events = true,
+    .supports_exclusive = true,
+};
+
+const struct engine_ops epoll_et_engine_ops = {
+    .name = "epoll-et",
+    .create = epoll_do_create,
+    .destroy = epoll_destroy,
+    .print_stats = epoll_print_stats,
+    .get_stats = epoll_get_stats,
+    .add_fd = epoll_add_fd,
+    .remove_fd = epoll_remove_fd,
+    .supports_adaptive_polling = true,
+    .supports_max_events = true,
     .supports_exclusive = true,
 };
+
+const struct engine_ops epoll_oneshot_engine_ops = {
+    .name = "epoll-oneshot",
+    .create = epoll_do_create,
+    .destroy = epoll_destroy,
+    .print_stats = epoll_print_stats,
+    .get_stats = epoll_get_stats,
+    .add_fd = epoll_add_fd,
+    .remove_fd = epoll_remove_fd,
+    .supports_adaptive_polling = true,
+    .supports_max_events = true,
+};
+
+const struct engine_ops epoll_lf_engine_ops = {
+    .name = "epoll-lf",
+    .create = epoll_do_create,
+    .destroy = epoll_destroy,
+    .print_stats = epoll_print_stats,
+    .get_stats = epoll_get_stats,
+    .add_fd = epoll_add_fd,
+    .remove_fd = epoll_remove_fd,
+    .supports_adaptive_polling = true,
+    .supports_max_events = true,
+};
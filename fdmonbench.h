@@ -8,16 +8,60 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 struct engine_ops;
 extern const struct engine_ops select_engine_ops;
 extern const struct engine_ops poll_engine_ops;
+extern const struct engine_ops reactor_engine_ops;
 extern const struct engine_ops epoll_engine_ops;
+extern const struct engine_ops epoll_et_engine_ops;
+extern const struct engine_ops epoll_oneshot_engine_ops;
+extern const struct engine_ops epoll_lf_engine_ops;
 extern const struct engine_ops io_uring_aio_engine_ops;
 extern const struct engine_ops io_uring_engine_ops;
+extern const struct engine_ops io_uring_link_engine_ops;
+extern const struct engine_ops io_uring_multishot_engine_ops;
+extern const struct engine_ops io_uring_recv_multishot_engine_ops;
+extern const struct engine_ops linux_aio_engine_ops;
+extern const struct engine_ops sigio_engine_ops;
+extern const struct engine_ops spin_engine_ops;
 extern const struct engine_ops threads_engine_ops;
 
+/* Flags for --io-uring-fixed= */
+enum {
+    IO_URING_FIXED_FILES = 1 << 0,
+    IO_URING_FIXED_BUFFERS = 1 << 1,
+};
+
+/* Flags for --io-uring-setup= */
+enum {
+    IO_URING_SETUP_SINGLE_ISSUER = 1 << 0,
+    IO_URING_SETUP_DEFER_TASKRUN = 1 << 1,
+    IO_URING_SETUP_COOP_TASKRUN = 1 << 2,
+};
+
+/* Values for --fd-distribution= */
+enum {
+    FD_DISTRIBUTION_SHARED, /* every engine monitors every fd */
+    FD_DISTRIBUTION_SHARDED, /* fds are dealt round-robin to engines */
+};
+
+/* Values for --fd-distribution-model= */
+enum {
+    FD_MODEL_UNIFORM, /* every fd is equally likely */
+    FD_MODEL_ZIPF, /* the k-th fd has weight 1/k^s */
+    FD_MODEL_HOTSET, /* a share of the fds gets a share of the messages */
+    FD_MODEL_SEQUENTIAL, /* round-robin over the fds */
+};
+
+/* Values for --arrival= */
+enum {
+    ARRIVAL_CONSTANT, /* fixed interval between sends */
+    ARRIVAL_POISSON, /* exponentially distributed intervals */
+};
+
 struct options {
     /* Engine type */
     const struct engine_ops *engine_ops;
@@ -28,16 +72,124 @@ struct options {
     /* Number of file descriptors to monitor */
     int num_fds;
 
+    /* How fds are distributed across engines (FD_DISTRIBUTION_*) */
+    int fd_distribution;
+
     /* Number of bytes to transfer in each message */
     size_t msg_size;
 
     /* Use EPOLLEXCLUSIVE? */
     bool exclusive;
 
+    /* Maximum number of events returned by each epoll_wait() */
+    int max_events;
+
+    /* Maximum adaptive polling time before blocking, or 0 to disable */
+    int64_t poll_max_ns;
+
+    /* Registered io_uring resources (IO_URING_FIXED_* flags) */
+    unsigned io_uring_fixed;
+
+    /* Additional io_uring setup flags (IO_URING_SETUP_* flags) */
+    unsigned io_uring_setup;
+
+    /* Use an io_uring SQ poller thread (IORING_SETUP_SQPOLL)? */
+    bool io_uring_sqpoll;
+
+    /* CPU to pin the SQ poller thread to, or -1 */
+    int io_uring_sq_thread_cpu;
+
+    /* SQ poller thread idle time before sleeping, or 0 for kernel default */
+    unsigned io_uring_sq_thread_idle_ms;
+
+    /* Number of provided buffers for multishot recv (power of 2) */
+    unsigned io_uring_buf_ring_size;
+
+    /* Number of worker threads, or 0 for one thread per fd */
+    int threads_pool_size;
+
+    /* Number of reactor worker threads */
+    int num_workers;
+
+    /* Open-loop send rate in messages per second, or 0 for closed-loop */
+    unsigned long rate;
+
+    /* Open-loop inter-arrival time distribution (ARRIVAL_*) */
+    int arrival;
+
+    /* Number of closed-loop messages in flight on distinct fds per generator */
+    int queue_depth;
+
+    /* Number of generator threads */
+    int num_generators;
+
+    /* How the generator picks the next fd (FD_MODEL_*) */
+    int fd_model;
+
+    /* Number of fds written back-to-back before collecting replies */
+    int burst;
+
+    /* Connections replaced per second (split across generators) or 0 */
+    unsigned long churn_rate;
+
+    /* Zipf exponent for FD_MODEL_ZIPF */
+    double fd_model_zipf_s;
+
+    /* Percentage of fds and of messages sent to them for FD_MODEL_HOTSET */
+    double fd_model_hot_pct;
+    double fd_model_hot_prob;
+
     /* How long to run */
     int duration_secs;
 };
 
+/* CLOCK_MONOTONIC time in nanoseconds */
+static inline int64_t get_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Per-engine service counters */
+struct engine_stats {
+    unsigned long wakeups; /* waits that returned at least one event */
+    unsigned long events; /* readiness notifications for fds */
+    unsigned long reads; /* reads that returned data */
+    unsigned long spurious; /* notifications where the read found no data */
+    uint64_t bytes; /* bytes echoed back */
+};
+
+static inline void engine_stats_add(struct engine_stats *dst,
+                                    const struct engine_stats *src)
+{
+    dst->wakeups += src->wakeups;
+    dst->events += src->events;
+    dst->reads += src->reads;
+    dst->spurious += src->spurious;
+    dst->bytes += src->bytes;
+}
+
+/*
+ * Read a message from fd and echo it back, returns the read(2) return value.
+ * Reads that find no data are not counted so callers can decide whether they
+ * were spurious.
+ */
+static inline ssize_t engine_echo(struct engine_stats *stats, int fd,
+                                  uint8_t *buf, size_t size)
+{
+    ssize_t len = read(fd, buf, size);
+
+    if (len > 0) {
+        stats->reads++;
+        if (write(fd, buf, len) == len) {
+            stats->bytes += len;
+        }
+    }
+    return len;
+}
+
 /* An engine instance */
 struct engine {
     const struct engine_ops *ops;
@@ -47,34 +199,189 @@ struct engine {
 struct engine_ops {
     const char *name;
 
-    /* Create a new engine instance from given options */
+    /* Create a new engine instance monitoring fds from given options */
     struct engine *(*create)(const struct options *opts,
                              int *fds,
+                             int num_fds,
                              char **errmsg);
 
     /* Destroy an engine instance and release its resources */
     void (*destroy)(struct engine *e);
 
+    /*
+     * Print engine-specific statistics after the run (optional). Called for
+     * each instance in turn, index 0 prints the CSV header.
+     */
+    void (*print_stats)(struct engine *e, int index, unsigned long num_ios);
+
+    /* Get service counters summed across the engine's threads (optional) */
+    void (*get_stats)(struct engine *e, struct engine_stats *stats);
+
+    /*
+     * Start or stop monitoring an fd while the engine is running (optional,
+     * needed for --churn-rate). The fd has no message in flight and is only
+     * closed after remove_fd() returns. Return false on failure.
+     */
+    bool (*add_fd)(struct engine *e, int fd);
+    bool (*remove_fd)(struct engine *e, int fd);
+
     /* Is EPOLLEXCLUSIVE supported? */
     bool supports_exclusive;
+
+    /* Are --io-uring-* options supported? */
+    bool supports_io_uring_options;
+
+    /* Is --poll-max-ns supported? */
+    bool supports_adaptive_polling;
+
+    /* Is --threads-pool-size supported? */
+    bool supports_threads_pool_size;
+
+    /* Is --num-workers supported? */
+    bool supports_num_workers;
+
+    /* Is --max-events supported? */
+    bool supports_max_events;
+};
+
+/*
+ * Log-linear histogram, similar to HdrHistogram. Values below
+ * HISTOGRAM_SUB_BUCKETS are exact and larger values are recorded with a
+ * relative error below 1/HISTOGRAM_SUB_BUCKETS. It uses constant memory and
+ * adding a value does not allocate.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total; /* number of values */
+    uint64_t sum; /* sum of values */
+    uint64_t max; /* largest value */
 };
 
+static inline void histogram_add(struct histogram *h, uint64_t value)
+{
+    int i = value;
+
+    if (value >= HISTOGRAM_SUB_BUCKETS) {
+        int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+
+        i = (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+            (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    }
+
+    h->counts[i]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+void histogram_init(struct histogram *h);
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+double histogram_mean(const struct histogram *h);
+
+/* Adaptive polling state, see adaptive_poll.c */
+struct adaptive_poll {
+    int64_t poll_ns; /* current polling time */
+    int64_t poll_max_ns; /* 0 disables polling */
+
+    /* Statistics */
+    unsigned long poll_hits; /* events found while polling */
+    unsigned long poll_misses; /* polled without finding events, then blocked */
+};
+
+void adaptive_poll_init(struct adaptive_poll *ap, int64_t poll_max_ns);
+int adaptive_poll_wait(struct adaptive_poll *ap,
+                       int (*wait_fn)(void *opaque, bool blocking),
+                       void *opaque);
+void adaptive_poll_print_header(const struct adaptive_poll *ap);
+void adaptive_poll_print_stats(const struct adaptive_poll *ap);
+
+/*
+ * Alias table for picking index i with probability proportional to a weight
+ * in constant time. The table is built once and sampling does not allocate.
+ */
+struct alias_table {
+    uint32_t *prob; /* chance of keeping column i, out of 2^31 */
+    int *alias; /* the other index in column i */
+    int n;
+};
+
+bool alias_table_init(struct alias_table *at, const double *weights, int n);
+void alias_table_destroy(struct alias_table *at);
+
+static inline int alias_table_sample(const struct alias_table *at,
+                                     struct random_data *random_buf)
+{
+    int32_t column;
+    int32_t coin;
+    int i;
+
+    random_r(random_buf, &column);
+    random_r(random_buf, &coin);
+
+    i = column % at->n;
+    return (uint32_t)coin < at->prob[i] ? i : at->alias[i];
+}
+
+struct iogen_thread;
+
 /* I/O generator */
 struct iogen {
     int *engine_fds;
     int *iogen_fds;
     int num_fds;
 
-    uint8_t *msgbuf;
     size_t msg_size;
 
-    struct random_data random_buf;
-    char random_state[256];
+    /* Report io_uring SQ poller thread CPU usage? */
+    bool sqpoll;
+
+    /* Open-loop send rate (messages per second) or 0 */
+    unsigned long rate;
+    int arrival;
+
+    /* Closed-loop messages in flight per generator thread */
+    int queue_depth;
+
+    /* How the next fd is picked (FD_MODEL_*) */
+    int fd_model;
+
+    /* Closed-loop messages sent back-to-back per generator thread */
+    int burst;
+
+    /* Connections replaced per second during the run, or 0 */
+    unsigned long churn_rate;
+
+    /* Engines that replaced fds are removed from and added to */
+    struct engine **engines;
+    int num_engines;
+    int fd_distribution;
+
+    /* Generator threads, each with a slice of the fds */
+    struct iogen_thread *threads;
+    int num_threads;
+
+    /* Number of messages sent in open-loop mode */
+    unsigned long num_sent;
 
     /* Number of completed I/O operations */
     unsigned long num_ios;
+
+    /* Number of connections replaced */
+    unsigned long num_churned;
+
+    /* Roundtrip latency in nanoseconds */
+    struct histogram latency_ns;
 };
 
 char *iogen_init(struct iogen *g, const struct options *opts);
 void iogen_cleanup(struct iogen *g);
+void iogen_set_engines(struct iogen *g, struct engine **engines,
+                       int num_engines);
 void iogen_run(struct iogen *g, volatile bool *stop);
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+#include "fdmonbench.h"
+
+void histogram_init(struct histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/* Add the counts from src to dst */
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/* Return the highest value that falls into bucket i */
+static uint64_t histogram_bucket_max(int i)
+{
+    int shift;
+
+    if (i < HISTOGRAM_SUB_BUCKETS) {
+        return i;
+    }
+
+    shift = i / HISTOGRAM_SUB_BUCKETS - 1;
+    return (((uint64_t)(i % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) + 1)
+            << shift) - 1;
+}
+
+/* Return the value below which percentile % of the recorded values fall */
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+    double rank = h->total * percentile / 100;
+    uint64_t threshold = rank;
+    uint64_t count = 0;
+
+    /* Round up, the smallest meaningful rank is 1 */
+    if (threshold < rank || threshold == 0) {
+        threshold++;
+    }
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += h->counts[i];
+        if (count >= threshold) {
+            uint64_t value = histogram_bucket_max(i);
+
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+double histogram_mean(const struct histogram *h)
+{
+    return h->total ? (double)h->sum / h->total : 0;
+}
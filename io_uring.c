@@ -4,23 +4,90 @@
 #include <liburing.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdatomic.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "fdmonbench.h"
 
+/* Commands passed to the engine thread by io_uring_add_fd()/remove_fd() */
+enum {
+    IO_URING_FD_CMD_NONE, /* the eventfd means stop */
+    IO_URING_FD_CMD_ADD,
+    IO_URING_FD_CMD_REMOVE,
+};
+
+/* user_data flag for IORING_OP_POLL_REMOVE completions */
+#define IO_URING_POLL_REMOVE_FLAG 0x4000000000000000ull
+
 struct io_uring_engine {
     struct engine engine;
     pthread_t thread;
     uint8_t *msgbuf;
     size_t msg_size;
+    size_t msgbuf_size; /* one message per fd in aio and link mode */
+    int *buf_index; /* fd -> msgbuf slot in aio and link mode, or NULL */
     sem_t startup_semaphore;
     struct io_uring ring;
     int efd; /* the eventfd */
     int poll_mask; /* the events we are monitoring */
     bool aio_mode; /* are we using aio mode? */
+    bool multishot; /* are we using multishot poll? */
+    bool recv_multishot; /* are we using multishot recv with a buf ring? */
+    bool link_mode; /* are we using linked poll->recv->send chains? */
+    bool fixed_buffers; /* is msgbuf registered as fixed buffer 0? */
+    int *file_index; /* fd -> registered file index, or NULL */
+
+    /* fds the thread starts monitoring, only valid during create */
+    int *init_fds;
+    int num_init_fds;
+    bool init_failed; /* could the thread not queue the initial sqes? */
+
+    /* Provided buffers for recv_multishot */
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *bufs;
+    unsigned num_bufs;
+    unsigned num_free_bufs; /* buffers currently owned by the kernel */
+
+    /* fds whose multishot recv stopped with -ENOBUFS */
+    int *nobufs_fds;
+    int num_nobufs_fds;
+
+    /* Only the engine thread touches the ring, others send it commands */
+    pthread_mutex_t fd_cmd_lock;
+    sem_t fd_cmd_done;
+    atomic_int fd_cmd; /* IO_URING_FD_CMD_* */
+    int fd_cmd_fd;
+    bool fd_cmd_ok; /* did the last command succeed? */
+    int removing_fd; /* fd whose poll is being cancelled, or -1 */
+
+    /* Statistics */
+    unsigned long num_submits;
+    unsigned long num_cqes;
+    struct histogram cqes_per_wait;
+    struct engine_stats stats;
+
+    struct adaptive_poll adaptive_poll;
 };
 
+/* Count a completion of I/O that the kernel did on our behalf */
+static void io_uring_update_stats(struct io_uring_engine *pe,
+                                  bool is_read,
+                                  int res)
+{
+    if (is_read) {
+        pe->stats.events++;
+        if (res > 0) {
+            pe->stats.reads++;
+        } else {
+            pe->stats.spurious++;
+        }
+    } else if (res > 0) {
+        pe->stats.bytes += res;
+    }
+}
+
 /* A version of io_uring_get_sqe() that tries harder */
 static struct io_uring_sqe *io_uring_get_sqe_always(struct io_uring_engine *pe)
 {
@@ -35,6 +102,7 @@ static struct io_uring_sqe *io_uring_get_sqe_always(struct io_uring_engine *pe)
     /* We allocate sufficient resources upfront so this should not fail */
 
     ret = io_uring_submit(&pe->ring);
+    pe->num_submits++;
     if (ret < 0) {
         fprintf(stderr, "io_uring_submit failed with %d\n", ret);
         return NULL;
@@ -49,80 +117,601 @@ static struct io_uring_sqe *io_uring_get_sqe_always(struct io_uring_engine *pe)
     return sqe;
 }
 
-static void io_uring_add_read_sqe(struct io_uring_engine *pe, int fd)
+/*
+ * In aio and link mode every fd has I/O in flight at the same time, so each
+ * fd gets its own slice of msgbuf.
+ */
+static uint8_t *io_uring_fd_buf(struct io_uring_engine *pe, int fd)
+{
+    if (pe->buf_index) {
+        return pe->msgbuf + (size_t)pe->buf_index[fd] * pe->msg_size;
+    }
+    return pe->msgbuf;
+}
+
+/* Switch sqe to the registered file if fds are registered */
+static void io_uring_sqe_set_file(struct io_uring_engine *pe,
+                                  struct io_uring_sqe *sqe,
+                                  int fd)
+{
+    if (pe->file_index) {
+        sqe->fd = pe->file_index[fd];
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+static bool io_uring_add_read_sqe(struct io_uring_engine *pe, int fd)
 {
     struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
 
-    io_uring_prep_read(sqe, fd, pe->msgbuf, pe->msg_size, 0);
+    if (!sqe) {
+        return false;
+    }
+
+    if (pe->fixed_buffers) {
+        io_uring_prep_read_fixed(sqe, fd, io_uring_fd_buf(pe, fd),
+                                 pe->msg_size, 0, 0);
+    } else {
+        io_uring_prep_read(sqe, fd, io_uring_fd_buf(pe, fd), pe->msg_size, 0);
+    }
+    io_uring_sqe_set_file(pe, sqe, fd);
     io_uring_sqe_set_data(sqe, (void *)(0x8000000000000000ull | (uintptr_t)fd));
+    return true;
+}
+
+static bool io_uring_add_write_sqe(struct io_uring_engine *pe, int fd)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
+
+    if (!sqe) {
+        return false;
+    }
+
+    if (pe->fixed_buffers) {
+        io_uring_prep_write_fixed(sqe, fd, io_uring_fd_buf(pe, fd),
+                                  pe->msg_size, 0, 0);
+    } else {
+        io_uring_prep_write(sqe, fd, io_uring_fd_buf(pe, fd), pe->msg_size, 0);
+    }
+    io_uring_sqe_set_file(pe, sqe, fd);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)fd);
+    return true;
 }
 
-static void io_uring_add_write_sqe(struct io_uring_engine *pe, int fd)
+static bool io_uring_add_poll_sqe(struct io_uring_engine *pe, int fd)
 {
     struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
 
-    io_uring_prep_write(sqe, fd, pe->msgbuf, pe->msg_size, 0);
+    if (!sqe) {
+        return false;
+    }
+
+    if (pe->multishot) {
+        io_uring_prep_poll_multishot(sqe, fd, pe->poll_mask);
+    } else {
+        io_uring_prep_poll_add(sqe, fd, pe->poll_mask);
+    }
+    io_uring_sqe_set_file(pe, sqe, fd);
     io_uring_sqe_set_data(sqe, (void *)(uintptr_t)fd);
+    return true;
 }
 
-static void io_uring_add_poll_sqe(struct io_uring_engine *pe, int fd)
+static bool io_uring_add_recv_multishot_sqe(struct io_uring_engine *pe, int fd)
 {
     struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
 
+    if (!sqe) {
+        return false;
+    }
+
+    /* The kernel picks a buffer from buffer group 0 */
+    io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    io_uring_sqe_set_file(pe, sqe, fd);
+    io_uring_sqe_set_data(sqe, (void *)(0x8000000000000000ull | (uintptr_t)fd));
+    return true;
+}
+
+/* Echo len bytes from provided buffer bid, the bid is stashed in user_data */
+static void io_uring_add_send_sqe(struct io_uring_engine *pe,
+                                  int fd,
+                                  unsigned bid,
+                                  unsigned len)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
+
+    if (!sqe) {
+        return;
+    }
+
+    io_uring_prep_send(sqe, fd, pe->bufs + bid * pe->msg_size, len, 0);
+    io_uring_sqe_set_file(pe, sqe, fd);
+    io_uring_sqe_set_data(sqe, (void *)(((uintptr_t)bid << 32) | (uint32_t)fd));
+}
+
+/* Give a provided buffer back to the kernel */
+static void io_uring_recycle_buf(struct io_uring_engine *pe, unsigned bid)
+{
+    io_uring_buf_ring_add(pe->buf_ring, pe->bufs + bid * pe->msg_size,
+                          pe->msg_size, bid,
+                          io_uring_buf_ring_mask(pe->num_bufs), 0);
+    io_uring_buf_ring_advance(pe->buf_ring, 1);
+    pe->num_free_bufs++;
+
+    /* Restart multishot recvs that ran out of buffers */
+    while (pe->num_nobufs_fds > 0) {
+        io_uring_add_recv_multishot_sqe(pe, pe->nobufs_fds[--pe->num_nobufs_fds]);
+    }
+}
+
+/* Handle a multishot recv or send completion */
+static void io_uring_recv_multishot_complete(struct io_uring_engine *pe,
+                                             uint64_t user_data,
+                                             int res,
+                                             unsigned flags)
+{
+    int fd = user_data;
+    bool is_recv = !!(0x8000000000000000ull & user_data);
+
+    if (!is_recv) {
+        io_uring_update_stats(pe, false, res);
+        io_uring_recycle_buf(pe, (user_data >> 32) & 0xffff);
+        return;
+    }
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        io_uring_update_stats(pe, true, res);
+
+        pe->num_free_bufs--;
+
+        if (res > 0) {
+            io_uring_add_send_sqe(pe, fd, bid, res);
+        } else {
+            io_uring_recycle_buf(pe, bid);
+        }
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        /* The send that frees a buffer may have completed already */
+        if (res == -ENOBUFS && pe->num_free_bufs == 0) {
+            pe->nobufs_fds[pe->num_nobufs_fds++] = fd;
+        } else {
+            io_uring_add_recv_multishot_sqe(pe, fd);
+        }
+    }
+}
+
+/* Set up the provided buffer ring used by multishot recv */
+static const char *io_uring_setup_bufs(struct io_uring_engine *pe,
+                                       int num_fds,
+                                       unsigned num_bufs)
+{
+    int ret;
+
+    pe->num_bufs = num_bufs;
+    pe->num_nobufs_fds = 0;
+    pe->nobufs_fds = malloc(sizeof(pe->nobufs_fds[0]) * num_fds);
+    pe->bufs = malloc(pe->msg_size * num_bufs);
+    if (!pe->nobufs_fds || !pe->bufs) {
+        free(pe->nobufs_fds);
+        free(pe->bufs);
+        return "Out of memory";
+    }
+
+    pe->buf_ring = io_uring_setup_buf_ring(&pe->ring, num_bufs, 0, 0, &ret);
+    if (!pe->buf_ring) {
+        free(pe->nobufs_fds);
+        free(pe->bufs);
+        return "io_uring_setup_buf_ring failed";
+    }
+
+    for (unsigned i = 0; i < num_bufs; i++) {
+        io_uring_buf_ring_add(pe->buf_ring, pe->bufs + i * pe->msg_size,
+                              pe->msg_size, i,
+                              io_uring_buf_ring_mask(num_bufs), i);
+    }
+    io_uring_buf_ring_advance(pe->buf_ring, num_bufs);
+    pe->num_free_bufs = num_bufs;
+    return NULL;
+}
+
+/*
+ * With IORING_SETUP_SINGLE_ISSUER only the engine thread may unregister the
+ * buffer ring once it has enabled the ring, so the thread calls this before
+ * it exits.
+ */
+static void io_uring_unregister_bufs(struct io_uring_engine *pe)
+{
+    int ret;
+
+    if (!pe->buf_ring) {
+        return;
+    }
+
+    ret = io_uring_free_buf_ring(&pe->ring, pe->buf_ring, pe->num_bufs, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_free_buf_ring failed with %d\n", ret);
+    }
+    pe->buf_ring = NULL;
+}
+
+static void io_uring_free_bufs(struct io_uring_engine *pe)
+{
+    io_uring_unregister_bufs(pe);
+    free(pe->nobufs_fds);
+    free(pe->bufs);
+}
+
+/*
+ * Queue a poll->recv->send chain that echoes one message without returning to
+ * userspace in between. Only the send completion is needed to resubmit the
+ * chain, so successful poll and recv completions are skipped if supported.
+ */
+static bool io_uring_add_link_sqes(struct io_uring_engine *pe, int fd)
+{
+    unsigned skip = pe->ring.features & IORING_FEAT_CQE_SKIP ?
+                    IOSQE_CQE_SKIP_SUCCESS : 0;
+    struct io_uring_sqe *sqe;
+
+    /* A chain is broken if it is split across submissions */
+    if (io_uring_sq_space_left(&pe->ring) < 3) {
+        io_uring_submit(&pe->ring);
+        pe->num_submits++;
+    }
+
+    sqe = io_uring_get_sqe_always(pe);
+    if (!sqe) {
+        return false;
+    }
     io_uring_prep_poll_add(sqe, fd, pe->poll_mask);
+    io_uring_sqe_set_file(pe, sqe, fd);
+    sqe->flags |= IOSQE_IO_LINK | skip;
+    io_uring_sqe_set_data(sqe, (void *)(0x8000000000000000ull | (uintptr_t)fd));
+
+    /* A short recv would break the chain, so wait for the whole message */
+    sqe = io_uring_get_sqe_always(pe);
+    if (!sqe) {
+        return false;
+    }
+    io_uring_prep_recv(sqe, fd, io_uring_fd_buf(pe, fd), pe->msg_size,
+                       MSG_WAITALL);
+    io_uring_sqe_set_file(pe, sqe, fd);
+    sqe->flags |= IOSQE_IO_LINK | skip;
+    io_uring_sqe_set_data(sqe, (void *)(0x8000000000000000ull | (uintptr_t)fd));
+
+    sqe = io_uring_get_sqe_always(pe);
+    if (!sqe) {
+        return false;
+    }
+    io_uring_prep_send(sqe, fd, io_uring_fd_buf(pe, fd), pe->msg_size, 0);
+    io_uring_sqe_set_file(pe, sqe, fd);
     io_uring_sqe_set_data(sqe, (void *)(uintptr_t)fd);
+    return true;
+}
+
+/* Handle a command from io_uring_fd_cmd() in the engine thread */
+static void io_uring_handle_fd_cmd(struct io_uring_engine *pe, int cmd)
+{
+    int fd = pe->fd_cmd_fd;
+
+    atomic_store_explicit(&pe->fd_cmd, IO_URING_FD_CMD_NONE,
+                          memory_order_relaxed);
+
+    if (cmd == IO_URING_FD_CMD_ADD) {
+        pe->fd_cmd_ok = io_uring_add_poll_sqe(pe, fd);
+        sem_post(&pe->fd_cmd_done);
+    } else {
+        struct io_uring_sqe *sqe = io_uring_get_sqe_always(pe);
+
+        pe->fd_cmd_ok = sqe != NULL;
+        if (!sqe) {
+            sem_post(&pe->fd_cmd_done);
+            return;
+        }
+
+        /* Done once the poll's final CQE arrives */
+        pe->removing_fd = fd;
+        io_uring_prep_poll_remove(sqe, (uintptr_t)fd);
+        io_uring_sqe_set_data64(sqe, IO_URING_POLL_REMOVE_FLAG | (uint32_t)fd);
+    }
+}
+
+/* Register fds and the eventfd so sqes can use IOSQE_FIXED_FILE */
+static const char *io_uring_register_fixed_files(struct io_uring_engine *pe,
+                                                 int *fds,
+                                                 int num_fds)
+{
+    int *files;
+    int max_fd = pe->efd;
+    int ret;
+
+    for (int i = 0; i < num_fds; i++) {
+        if (fds[i] > max_fd) {
+            max_fd = fds[i];
+        }
+    }
+
+    files = malloc(sizeof(files[0]) * (num_fds + 1));
+    pe->file_index = malloc(sizeof(pe->file_index[0]) * (max_fd + 1));
+    if (!files || !pe->file_index) {
+        free(files);
+        free(pe->file_index);
+        pe->file_index = NULL;
+        return "Out of memory";
+    }
+
+    memcpy(files, fds, sizeof(files[0]) * num_fds);
+    files[num_fds] = pe->efd;
+
+    for (int i = 0; i < num_fds + 1; i++) {
+        pe->file_index[files[i]] = i;
+    }
+
+    ret = io_uring_register_files(&pe->ring, files, num_fds + 1);
+    free(files);
+    if (ret < 0) {
+        free(pe->file_index);
+        pe->file_index = NULL;
+        return "io_uring_register_files failed (do you need to increase ulimit -n?)";
+    }
+
+    return NULL;
+}
+
+/* Setup flags that are dropped if the kernel does not support them */
+static const struct {
+    unsigned flags;
+    const char *name;
+} io_uring_optional_setup_flags[] = {
+    /* Newest first */
+    {IORING_SETUP_DEFER_TASKRUN, "IORING_SETUP_DEFER_TASKRUN"},
+    {IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED,
+     "IORING_SETUP_SINGLE_ISSUER"},
+    {IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG,
+     "IORING_SETUP_COOP_TASKRUN"},
+};
+
+/* Create the ring, probing for supported setup flags */
+static int io_uring_init_ring(struct io_uring_engine *pe,
+                              unsigned entries,
+                              struct io_uring_params *params)
+{
+    size_t num_flags = sizeof(io_uring_optional_setup_flags) /
+                       sizeof(io_uring_optional_setup_flags[0]);
+    struct io_uring_params p = *params;
+    size_t i;
+    int ret;
+
+    ret = io_uring_queue_init_params(entries, &pe->ring, &p);
+    if (ret != -EINVAL) {
+        return ret;
+    }
+
+    /* Only blame optional flags if the ring works without any of them */
+    p = *params;
+    for (i = 0; i < num_flags; i++) {
+        p.flags &= ~io_uring_optional_setup_flags[i].flags;
+    }
+    if (p.flags == params->flags) {
+        return ret;
+    }
+
+    ret = io_uring_queue_init_params(entries, &pe->ring, &p);
+    if (ret < 0) {
+        return ret;
+    }
+    io_uring_queue_exit(&pe->ring);
+
+    for (i = 0; i < num_flags; i++) {
+        if (!(params->flags & io_uring_optional_setup_flags[i].flags)) {
+            continue;
+        }
+
+        fprintf(stderr, "io_uring_setup rejected %s, retrying without it\n",
+                io_uring_optional_setup_flags[i].name);
+        params->flags &= ~io_uring_optional_setup_flags[i].flags;
+
+        p = *params;
+        ret = io_uring_queue_init_params(entries, &pe->ring, &p);
+        if (ret != -EINVAL) {
+            return ret;
+        }
+    }
+    return ret;
+}
+
+static int io_uring_wait_cqes(void *opaque, bool blocking)
+{
+    struct io_uring_engine *pe = opaque;
+    struct io_uring_cqe *cqe;
+
+    if (blocking) {
+        io_uring_submit_and_wait(&pe->ring, 1);
+        pe->num_submits++;
+        return io_uring_cq_ready(&pe->ring);
+    }
+
+    if (io_uring_sq_ready(&pe->ring) > 0) {
+        io_uring_submit(&pe->ring);
+        pe->num_submits++;
+    }
+
+    /* Deferred task work only runs when we enter the kernel */
+    if (pe->ring.flags & IORING_SETUP_DEFER_TASKRUN) {
+        io_uring_get_events(&pe->ring);
+    }
+
+    /* This also flushes overflowed CQEs and IORING_SQ_TASKRUN task work */
+    io_uring_peek_cqe(&pe->ring, &cqe);
+    return io_uring_cq_ready(&pe->ring);
+}
+
+/* Start monitoring the fds and the eventfd */
+static bool io_uring_add_initial_sqes(struct io_uring_engine *pe)
+{
+    for (int i = 0; i < pe->num_init_fds; i++) {
+        int fd = pe->init_fds[i];
+        bool ok;
+
+        if (pe->aio_mode) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+            ok = io_uring_add_read_sqe(pe, fd);
+        } else if (pe->recv_multishot) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+            ok = io_uring_add_recv_multishot_sqe(pe, fd);
+        } else if (pe->link_mode) {
+            ok = io_uring_add_link_sqes(pe, fd);
+        } else {
+            ok = io_uring_add_poll_sqe(pe, fd);
+        }
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return io_uring_add_poll_sqe(pe, pe->efd);
 }
 
 static void *io_uring_thread(void *opaque)
 {
     struct io_uring_engine *pe = opaque;
 
+    /*
+     * With IORING_SETUP_SINGLE_ISSUER the ring is created disabled and the
+     * thread that enables it becomes the submitter task.
+     */
+    if (pe->ring.flags & IORING_SETUP_R_DISABLED) {
+        io_uring_enable_rings(&pe->ring);
+    }
+
+    /* The ring may fill up and need submitting, so it must be enabled */
+    if (!io_uring_add_initial_sqes(pe)) {
+        pe->init_failed = true;
+        io_uring_unregister_bufs(pe);
+        sem_post(&pe->startup_semaphore);
+        return NULL;
+    }
+
+    /* Flush pending sqes to kernel */
+    io_uring_submit(&pe->ring);
+    pe->num_submits++;
+
     /* Ready! */
     sem_post(&pe->startup_semaphore);
 
     for (;;) {
         struct io_uring_cqe *cqe;
+        unsigned num_cqes = 0;
         unsigned head;
 
-        io_uring_submit_and_wait(&pe->ring, 1);
+        adaptive_poll_wait(&pe->adaptive_poll, io_uring_wait_cqes, pe);
 
         io_uring_for_each_cqe(&pe->ring, head, cqe) {
-            int fd = cqe->user_data;
-            bool is_aio_read = !!(0x8000000000000000ull & cqe->user_data);
+            uint64_t user_data = cqe->user_data;
+            int fd = user_data;
+            bool is_aio_read = !!(0x8000000000000000ull & user_data);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            bool more = flags & IORING_CQE_F_MORE;
+
+            pe->num_cqes++;
+            num_cqes++;
+
+            /*
+             * A poll that already terminated cannot be cancelled, but then
+             * its final CQE was seen before this one.
+             */
+            if (user_data & IO_URING_POLL_REMOVE_FLAG) {
+                io_uring_cq_advance(&pe->ring, 1);
+                continue;
+            }
+
+            /* The poll of an fd being removed is gone, don't re-arm it */
+            if (fd == pe->removing_fd && !more) {
+                pe->removing_fd = -1;
+                sem_post(&pe->fd_cmd_done);
+                io_uring_cq_advance(&pe->ring, 1);
+                continue;
+            }
 
             /* Handle our eventfd */
             if (fd == pe->efd) {
                 uint64_t eventfd_val;
+                int cmd;
 
                 if (read(fd, &eventfd_val, sizeof(eventfd_val)) != sizeof(eventfd_val)) {
                     goto requeue;
                 }
 
+                cmd = atomic_load_explicit(&pe->fd_cmd, memory_order_acquire);
+                if (cmd != IO_URING_FD_CMD_NONE) {
+                    io_uring_handle_fd_cmd(pe, cmd);
+                    goto requeue;
+                }
+
                 /* Stop thread */
+                io_uring_unregister_bufs(pe);
                 return NULL;
             }
 
             /* Poll completed, now read and write back the message */
-            if (!pe->aio_mode) {
-                if (read(fd, pe->msgbuf, pe->msg_size) <= 0) {
+            if (!pe->aio_mode && !pe->recv_multishot && !pe->link_mode) {
+                pe->stats.events++;
+
+                if (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) <= 0) {
+                    pe->stats.spurious++;
                     goto requeue;
                 }
-                write(fd, pe->msgbuf, pe->msg_size);
+
+                /*
+                 * Multishot poll is edge-triggered, so no further CQE is
+                 * posted for messages that are already queued. Echo them all.
+                 */
+                if (pe->multishot) {
+                    while (engine_echo(&pe->stats, fd, pe->msgbuf,
+                                       pe->msg_size) > 0) {
+                        /* nothing */
+                    }
+                }
             }
 
-requeue:    /* Submit another IORING_OP_POLL_ADD since it's a oneshot */
+requeue:    /*
+             * Submit another IORING_OP_POLL_ADD if it was a oneshot or the
+             * kernel terminated the multishot poll.
+             */
             io_uring_cq_advance(&pe->ring, 1);
 
-            if (fd != pe->efd && pe->aio_mode) {
+            if (fd != pe->efd && pe->recv_multishot) {
+                io_uring_recv_multishot_complete(pe, user_data, res, flags);
+            } else if (fd != pe->efd && pe->link_mode) {
+                /* Resubmit once the send at the end of the chain is done */
+                if (!is_aio_read) {
+                    /* Successful recvs may not post CQEs, so count the send */
+                    io_uring_update_stats(pe, true, res);
+                    io_uring_update_stats(pe, false, res);
+                    io_uring_add_link_sqes(pe, fd);
+                }
+            } else if (fd != pe->efd && pe->aio_mode) {
+                io_uring_update_stats(pe, is_aio_read, res);
+
                 if (is_aio_read) {
                     io_uring_add_write_sqe(pe, fd);
                 } else {
                     io_uring_add_read_sqe(pe, fd);
                 }
-            } else {
+            } else if (!more) {
                 io_uring_add_poll_sqe(pe, fd);
             }
         }
+
+        histogram_add(&pe->cqes_per_wait, num_cqes);
+        if (num_cqes > 0) {
+            pe->stats.wakeups++;
+        }
     }
 
     return NULL;
@@ -130,13 +719,28 @@ requeue:    /* Submit another IORING_OP_POLL_ADD since it's a oneshot */
 
 static struct engine *io_uring_create(const struct options *opts,
                                       int *fds,
+                                      int num_fds,
                                       char **errmsg)
 {
     const char *err = NULL;
     struct io_uring_engine *pe;
+    struct io_uring_params params = {0};
     unsigned entries;
     int ret;
 
+    /* Added fds would need a registered file slot */
+    if (opts->churn_rate && (opts->io_uring_fixed & IO_URING_FIXED_FILES)) {
+        *errmsg = strdup("churn-rate cannot be combined with io-uring-fixed=files");
+        return NULL;
+    }
+
+    /* Poll mode uses read(2)/write(2) so there is no buffer to register */
+    if ((opts->io_uring_fixed & IO_URING_FIXED_BUFFERS) &&
+        opts->engine_ops != &io_uring_aio_engine_ops) {
+        *errmsg = strdup("Fixed buffers are only supported by the io_uring-aio engine");
+        return NULL;
+    }
+
     pe = malloc(sizeof(*pe));
     if (!pe) {
         *errmsg = strdup("Out of memory");
@@ -145,6 +749,19 @@ static struct engine *io_uring_create(const struct options *opts,
 
     pe->engine.ops = opts->engine_ops;
     pe->aio_mode = opts->engine_ops == &io_uring_aio_engine_ops;
+    pe->multishot = opts->engine_ops == &io_uring_multishot_engine_ops;
+    pe->recv_multishot = opts->engine_ops == &io_uring_recv_multishot_engine_ops;
+    pe->link_mode = opts->engine_ops == &io_uring_link_engine_ops;
+    pe->num_submits = 0;
+    pe->num_cqes = 0;
+    histogram_init(&pe->cqes_per_wait);
+    memset(&pe->stats, 0, sizeof(pe->stats));
+    adaptive_poll_init(&pe->adaptive_poll, opts->poll_max_ns);
+    pe->fixed_buffers = opts->io_uring_fixed & IO_URING_FIXED_BUFFERS;
+    pe->file_index = NULL;
+    pe->buf_ring = NULL;
+    atomic_init(&pe->fd_cmd, IO_URING_FD_CMD_NONE);
+    pe->removing_fd = -1;
 
     pe->poll_mask = POLLIN;
     if (opts->exclusive) {
@@ -152,35 +769,71 @@ static struct engine *io_uring_create(const struct options *opts,
     }
 
     pe->msg_size = opts->msg_size;
-    pe->msgbuf = calloc(1, opts->msg_size);
+    pe->msgbuf_size = opts->msg_size;
+    pe->buf_index = NULL;
+    if (pe->aio_mode || pe->link_mode) {
+        int max_fd = 0;
+
+        for (int i = 0; i < num_fds; i++) {
+            if (fds[i] > max_fd) {
+                max_fd = fds[i];
+            }
+        }
+
+        pe->buf_index = malloc(sizeof(pe->buf_index[0]) * (max_fd + 1));
+        if (!pe->buf_index) {
+            err = "Out of memory";
+            goto err_free_se;
+        }
+
+        for (int i = 0; i < num_fds; i++) {
+            pe->buf_index[fds[i]] = i;
+        }
+        pe->msgbuf_size *= num_fds;
+    }
+
+    pe->msgbuf = calloc(1, pe->msgbuf_size);
     if (!pe->msgbuf) {
         err = "Out of memory";
-        goto err_free_se;
+        goto err_free_buf_index;
     }
 
     /* When polling we don't need to reserve many entries */
     if (pe->aio_mode) {
-        entries = opts->num_fds * 2 + 1;
+        entries = num_fds * 2 + 1;
+    } else if (pe->recv_multishot) {
+        /* At most one send per buffer is in flight */
+        entries = opts->io_uring_buf_ring_size + 1;
     } else {
         entries = 64;
     }
 
-    ret = io_uring_queue_init(entries, &pe->ring, 0);
+    if (opts->io_uring_sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = opts->io_uring_sq_thread_idle_ms;
+
+        if (opts->io_uring_sq_thread_cpu >= 0) {
+            params.flags |= IORING_SETUP_SQ_AFF;
+            params.sq_thread_cpu = opts->io_uring_sq_thread_cpu;
+        }
+    }
+
+    if (opts->io_uring_setup & IO_URING_SETUP_SINGLE_ISSUER) {
+        params.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED;
+    }
+    if (opts->io_uring_setup & IO_URING_SETUP_DEFER_TASKRUN) {
+        params.flags |= IORING_SETUP_DEFER_TASKRUN;
+    }
+    if (opts->io_uring_setup & IO_URING_SETUP_COOP_TASKRUN) {
+        params.flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    }
+
+    ret = io_uring_init_ring(pe, entries, &params);
     if (ret < 0) {
         err = "io_uring_queue_init failed (do you need to increase ulimit -l?)";
         goto err_free_msgbuf;
     }
 
-    for (int i = 0; i < opts->num_fds; i++) {
-        if (pe->aio_mode) {
-            fcntl(fds[i], F_SETFL,
-                  fcntl(fds[i], F_GETFL, 0) & ~O_NONBLOCK);
-            io_uring_add_read_sqe(pe, fds[i]);
-        } else {
-            io_uring_add_poll_sqe(pe, fds[i]);
-        }
-    }
-
     /* The eventfd is used to tell the thread to stop */
     pe->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
     if (pe->efd < 0) {
@@ -188,21 +841,56 @@ static struct engine *io_uring_create(const struct options *opts,
         goto err_queue_exit;
     }
 
-    io_uring_add_poll_sqe(pe, pe->efd);
+    if (opts->io_uring_fixed & IO_URING_FIXED_FILES) {
+        err = io_uring_register_fixed_files(pe, fds, num_fds);
+        if (err) {
+            goto err_close_eventfd;
+        }
+    }
 
-    /* Flush pending sqes to kernel */
-    io_uring_submit(&pe->ring);
+    if (pe->fixed_buffers) {
+        struct iovec iov = {
+            .iov_base = pe->msgbuf,
+            .iov_len = pe->msgbuf_size,
+        };
+
+        ret = io_uring_register_buffers(&pe->ring, &iov, 1);
+        if (ret < 0) {
+            err = "io_uring_register_buffers failed (do you need to increase ulimit -l?)";
+            goto err_free_file_index;
+        }
+    }
+
+    if (pe->recv_multishot) {
+        err = io_uring_setup_bufs(pe, num_fds,
+                                  opts->io_uring_buf_ring_size);
+        if (err) {
+            goto err_free_file_index;
+        }
+    }
+
+    /* The thread queues the initial sqes once the ring is enabled */
+    pe->init_fds = fds;
+    pe->num_init_fds = num_fds;
+    pe->init_failed = false;
 
     /* The semaphore is used to wait for the thread to become ready */
     if (sem_init(&pe->startup_semaphore, 0, 0) < 0) {
         err = "Failed to create startup semaphore";
-        goto err_close_eventfd;
+        goto err_free_bufs;
+    }
+
+    /* The semaphore is used to wait for fd commands to complete */
+    if (sem_init(&pe->fd_cmd_done, 0, 0) < 0) {
+        err = "Failed to create fd command semaphore";
+        goto err_sem_destroy;
     }
+    pthread_mutex_init(&pe->fd_cmd_lock, NULL);
 
     /* Start thread */
     if (pthread_create(&pe->thread, NULL, io_uring_thread, pe) != 0) {
         err = "pthread_create failed";
-        goto err_sem_destroy;
+        goto err_fd_cmd_destroy;
     }
 
     /* Wait for thread to become ready */
@@ -215,18 +903,34 @@ static struct engine *io_uring_create(const struct options *opts,
         goto err_pthread_join;
     }
 
+    if (pe->init_failed) {
+        err = "Failed to queue initial io_uring sqes";
+        goto err_pthread_join;
+    }
+
     return &pe->engine;
 
 err_pthread_join:
     pthread_join(pe->thread, NULL);
+err_fd_cmd_destroy:
+    pthread_mutex_destroy(&pe->fd_cmd_lock);
+    sem_destroy(&pe->fd_cmd_done);
 err_sem_destroy:
     sem_destroy(&pe->startup_semaphore);
+err_free_bufs:
+    if (pe->recv_multishot) {
+        io_uring_free_bufs(pe);
+    }
+err_free_file_index:
+    free(pe->file_index);
 err_close_eventfd:
     close(pe->efd);
 err_queue_exit:
     io_uring_queue_exit(&pe->ring);
 err_free_msgbuf:
     free(pe->msgbuf);
+err_free_buf_index:
+    free(pe->buf_index);
 err_free_se:
     free(pe);
     *errmsg = strdup(err);
@@ -241,23 +945,138 @@ static void io_uring_destroy(struct engine *e)
     write(pe->efd, &eventfd_val, sizeof(eventfd_val));
     pthread_join(pe->thread, NULL);
 
+    pthread_mutex_destroy(&pe->fd_cmd_lock);
+    sem_destroy(&pe->fd_cmd_done);
     sem_destroy(&pe->startup_semaphore);
 
     close(pe->efd);
+    if (pe->recv_multishot) {
+        io_uring_free_bufs(pe);
+    }
     io_uring_queue_exit(&pe->ring);
+    free(pe->file_index);
     free(pe->msgbuf);
+    free(pe->buf_index);
     free(pe);
 }
 
+/* Hand an fd command to the engine thread and wait for it to complete */
+static bool io_uring_fd_cmd(struct io_uring_engine *pe, int cmd, int fd)
+{
+    uint64_t eventfd_val = 1;
+    int ret;
+
+    pthread_mutex_lock(&pe->fd_cmd_lock);
+
+    pe->fd_cmd_fd = fd;
+    atomic_store_explicit(&pe->fd_cmd, cmd, memory_order_release);
+    write(pe->efd, &eventfd_val, sizeof(eventfd_val));
+
+    do {
+        ret = sem_wait(&pe->fd_cmd_done);
+    } while (ret == -1 && errno == EINTR);
+
+    pthread_mutex_unlock(&pe->fd_cmd_lock);
+    return ret == 0 && pe->fd_cmd_ok;
+}
+
+static bool io_uring_add_fd(struct engine *e, int fd)
+{
+    return io_uring_fd_cmd((struct io_uring_engine *)e,
+                           IO_URING_FD_CMD_ADD, fd);
+}
+
+/* Cancel the fd's poll, this is the cost that connection churn exercises */
+static bool io_uring_remove_fd(struct engine *e, int fd)
+{
+    return io_uring_fd_cmd((struct io_uring_engine *)e,
+                           IO_URING_FD_CMD_REMOVE, fd);
+}
+
+static void io_uring_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct io_uring_engine *pe = (struct io_uring_engine *)e;
+
+    *stats = pe->stats;
+}
+
+static void io_uring_print_stats(struct engine *e,
+                                 int index,
+                                 unsigned long num_ios)
+{
+    struct io_uring_engine *pe = (struct io_uring_engine *)e;
+    struct histogram *h = &pe->cqes_per_wait;
+
+    if (index == 0) {
+        printf("Engine,Submits,CQEs,Submits/roundtrip,CQEs/roundtrip,CQEs/wait,CQEs/wait p50,CQEs/wait p99,CQEs/wait max");
+        adaptive_poll_print_header(&pe->adaptive_poll);
+        printf("\n");
+    }
+    printf("%d,%lu,%lu,%g,%g,%g,%lu,%lu,%lu", index,
+           pe->num_submits, pe->num_cqes,
+           (double)pe->num_submits / num_ios,
+           (double)pe->num_cqes / num_ios,
+           histogram_mean(h),
+           (unsigned long)histogram_percentile(h, 50),
+           (unsigned long)histogram_percentile(h, 99),
+           (unsigned long)h->max);
+    adaptive_poll_print_stats(&pe->adaptive_poll);
+    printf("\n");
+}
+
 const struct engine_ops io_uring_engine_ops = {
     .name = "io_uring",
     .create = io_uring_create,
     .destroy = io_uring_destroy,
+    .print_stats = io_uring_print_stats,
+    .get_stats = io_uring_get_stats,
+    .add_fd = io_uring_add_fd,
+    .remove_fd = io_uring_remove_fd,
     .supports_exclusive = true,
+    .supports_io_uring_options = true,
+    .supports_adaptive_polling = true,
 };
 
 const struct engine_ops io_uring_aio_engine_ops = {
     .name = "io_uring-aio",
     .create = io_uring_create,
     .destroy = io_uring_destroy,
+    .print_stats = io_uring_print_stats,
+    .get_stats = io_uring_get_stats,
+    .supports_io_uring_options = true,
+    .supports_adaptive_polling = true,
+};
+
+const struct engine_ops io_uring_multishot_engine_ops = {
+    .name = "io_uring-multishot",
+    .create = io_uring_create,
+    .destroy = io_uring_destroy,
+    .print_stats = io_uring_print_stats,
+    .get_stats = io_uring_get_stats,
+    .add_fd = io_uring_add_fd,
+    .remove_fd = io_uring_remove_fd,
+    .supports_exclusive = true,
+    .supports_io_uring_options = true,
+    .supports_adaptive_polling = true,
+};
+
+const struct engine_ops io_uring_recv_multishot_engine_ops = {
+    .name = "io_uring-recv-multishot",
+    .create = io_uring_create,
+    .destroy = io_uring_destroy,
+    .print_stats = io_uring_print_stats,
+    .get_stats = io_uring_get_stats,
+    .supports_io_uring_options = true,
+    .supports_adaptive_polling = true,
+};
+
+const struct engine_ops io_uring_link_engine_ops = {
+    .name = "io_uring-link",
+    .create = io_uring_create,
+    .destroy = io_uring_destroy,
+    .print_stats = io_uring_print_stats,
+    .get_stats = io_uring_get_stats,
+    .supports_exclusive = true,
+    .supports_io_uring_options = true,
+    .supports_adaptive_polling = true,
 };
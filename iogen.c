@@ -1,58 +1,216 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
+#include <dirent.h>
 #include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include "fdmonbench.h"
 
+/* One generator thread and its share of the fds */
+struct iogen_thread {
+    struct iogen *g;
+    pthread_t thread;
+    sem_t *startup_semaphore;
+    pthread_barrier_t *barrier;
+    volatile bool *stop;
+
+    int *fds; /* slice of iogen_fds */
+    int num_fds;
+    uint8_t *msgbuf;
+
+    struct random_data random_buf;
+    char random_state[256];
+
+    /* Fd weights for FD_MODEL_ZIPF and FD_MODEL_HOTSET */
+    struct alias_table fd_table;
+
+    /* Open-loop send rate (messages per second) or 0 */
+    unsigned long rate;
+
+    /* Connections replaced per second or 0, and when the next one is due */
+    unsigned long churn_rate;
+    int64_t next_churn_ns;
+
+    /* Number of messages sent in open-loop mode */
+    unsigned long num_sent;
+
+    /* Number of connections replaced */
+    unsigned long num_churned;
+
+    /* Number of completed I/O operations */
+    unsigned long num_ios;
+
+    /* Roundtrip latency in nanoseconds */
+    struct histogram latency_ns;
+};
+
+static void iogen_free_threads(struct iogen *g)
+{
+    for (int i = 0; i < g->num_threads; i++) {
+        alias_table_destroy(&g->threads[i].fd_table);
+        free(g->threads[i].msgbuf);
+    }
+    free(g->threads);
+}
+
+/* Build the alias table for skewed fd selection, the first fds are hottest */
+static bool iogen_thread_init_fd_model(struct iogen_thread *t,
+                                       const struct options *opts)
+{
+    double *weights;
+    bool ret;
+    int n = t->num_fds;
+
+    if (opts->fd_model != FD_MODEL_ZIPF && opts->fd_model != FD_MODEL_HOTSET) {
+        return true;
+    }
+
+    weights = calloc(n, sizeof(weights[0]));
+    if (!weights) {
+        return false;
+    }
+
+    if (opts->fd_model == FD_MODEL_ZIPF) {
+        for (int i = 0; i < n; i++) {
+            weights[i] = 1 / pow(i + 1, opts->fd_model_zipf_s);
+        }
+    } else {
+        int num_hot = lround(n * opts->fd_model_hot_pct / 100);
+
+        if (num_hot < 1) {
+            num_hot = 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (num_hot >= n) {
+                weights[i] = 1; /* every fd is hot */
+            } else if (i < num_hot) {
+                weights[i] = opts->fd_model_hot_prob / num_hot;
+            } else {
+                weights[i] = (100 - opts->fd_model_hot_prob) / (n - num_hot);
+            }
+        }
+    }
+
+    ret = alias_table_init(&t->fd_table, weights, n);
+    free(weights);
+    return ret;
+}
+
+/* Create a socketpair for fd index i, the engine fd is non-blocking */
+static bool iogen_open_fd(struct iogen *g, int i)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        return false;
+    }
+
+    g->engine_fds[i] = fds[0];
+    g->iogen_fds[i] = fds[1];
+
+    fcntl(g->engine_fds[i], F_SETFL,
+          O_NONBLOCK | fcntl(g->engine_fds[i], F_GETFL, 0));
+    return true;
+}
+
 char *iogen_init(struct iogen *g, const struct options *opts)
 {
+    int i;
+
     g->num_fds = opts->num_fds;
     g->msg_size = opts->msg_size;
-
-    memset(&g->random_buf, 0, sizeof(g->random_buf));
-    initstate_r(gettid(), g->random_state, sizeof(g->random_state), &g->random_buf);
+    g->sqpoll = opts->io_uring_sqpoll;
+    g->rate = opts->rate;
+    g->arrival = opts->arrival;
+    g->queue_depth = opts->queue_depth;
+    g->fd_model = opts->fd_model;
+    g->burst = opts->burst;
+    g->churn_rate = opts->churn_rate;
+    g->fd_distribution = opts->fd_distribution;
+    g->engines = NULL;
+    g->num_engines = 0;
+    g->num_churned = 0;
+    g->num_sent = 0;
+    g->num_ios = 0;
+    histogram_init(&g->latency_ns);
 
     g->engine_fds = malloc(sizeof(g->engine_fds[0]) * opts->num_fds);
     g->iogen_fds = malloc(sizeof(g->engine_fds[0]) * opts->num_fds);
-    g->msgbuf = calloc(1, opts->msg_size);
-    if (!g->engine_fds || !g->iogen_fds || !g->msgbuf) {
+    if (!g->engine_fds || !g->iogen_fds) {
+        free(g->engine_fds);
+        free(g->iogen_fds);
+        return strdup("Out of memory");
+    }
+
+    /* Each generator owns a contiguous slice of the fds and of the rate */
+    g->num_threads = opts->num_generators;
+    g->threads = calloc(g->num_threads, sizeof(g->threads[0]));
+    if (!g->threads) {
         free(g->engine_fds);
         free(g->iogen_fds);
-        free(g->msgbuf);
         return strdup("Out of memory");
     }
 
-    for (int i = 0; i < opts->num_fds; i++) {
-        int fds[2];
-        int ret;
+    for (i = 0; i < g->num_threads; i++) {
+        struct iogen_thread *t = &g->threads[i];
+        int first_fd = (long)i * g->num_fds / g->num_threads;
+        int end_fd = (long)(i + 1) * g->num_fds / g->num_threads;
 
-        ret = socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
-        if (ret < 0) {
+        t->g = g;
+        t->fds = &g->iogen_fds[first_fd];
+        t->num_fds = end_fd - first_fd;
+        t->rate = g->rate / g->num_threads +
+                  ((unsigned long)i < g->rate % g->num_threads);
+        t->churn_rate = g->churn_rate / g->num_threads +
+                        ((unsigned long)i < g->churn_rate % g->num_threads);
+        histogram_init(&t->latency_ns);
+
+        initstate_r(gettid() + i, t->random_state, sizeof(t->random_state),
+                    &t->random_buf);
+
+        t->msgbuf = calloc(1, opts->msg_size);
+        if (!t->msgbuf || !iogen_thread_init_fd_model(t, opts)) {
+            iogen_free_threads(g);
+            free(g->engine_fds);
+            free(g->iogen_fds);
+            return strdup("Out of memory");
+        }
+    }
+
+    for (i = 0; i < opts->num_fds; i++) {
+        if (!iogen_open_fd(g, i)) {
             while (i-- > 0) {
                 close(g->engine_fds[i]);
                 close(g->iogen_fds[i]);
-                free(g->engine_fds);
-                free(g->iogen_fds);
-                free(g->msgbuf);
-                return strdup("socketpair failed\n");
             }
+            iogen_free_threads(g);
+            free(g->engine_fds);
+            free(g->iogen_fds);
+            return strdup("socketpair failed");
         }
-
-        g->engine_fds[i] = fds[0];
-        g->iogen_fds[i] = fds[1];
-
-        /* The engine fd is non-blocking, the iogen fd is blocking */
-        fcntl(g->engine_fds[i], F_SETFL,
-              O_NONBLOCK | fcntl(g->engine_fds[i], F_GETFL, 0));
     }
 
     return NULL;
 }
 
+/* Tell the generator which engines to update when replacing connections */
+void iogen_set_engines(struct iogen *g, struct engine **engines,
+                       int num_engines)
+{
+    g->engines = engines;
+    g->num_engines = num_engines;
+}
+
 void iogen_cleanup(struct iogen *g)
 {
     for (int i = 0; i < g->num_fds; i++) {
@@ -60,21 +218,77 @@ void iogen_cleanup(struct iogen *g)
         close(g->iogen_fds[i]);
     }
 
+    iogen_free_threads(g);
     free(g->engine_fds);
     free(g->iogen_fds);
-    free(g->msgbuf);
+}
+
+/*
+ * Return the CPU usage of io_uring SQ poller threads in seconds. They are
+ * named iou-sqp-<pid> and belong to our thread group on Linux 5.12 and later.
+ */
+static double sqpoll_cpu_secs(void)
+{
+    struct dirent *dirent;
+    double secs = 0;
+    DIR *dir;
+
+    dir = opendir("/proc/self/task");
+    if (!dir) {
+        return 0;
+    }
+
+    while ((dirent = readdir(dir))) {
+        unsigned long utime;
+        unsigned long stime;
+        char path[PATH_MAX];
+        char buf[512];
+        char *p;
+        FILE *fp;
+
+        if (dirent->d_name[0] == '.') {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", dirent->d_name);
+        fp = fopen(path, "r");
+        if (!fp) {
+            continue;
+        }
+        p = fgets(buf, sizeof(buf), fp);
+        fclose(fp);
+
+        if (!p || !strstr(buf, "(iou-sqp-")) {
+            continue;
+        }
+
+        /* utime and stime are fields 14 and 15, counting from "pid (comm)" */
+        p = strrchr(buf, ')');
+        if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                         &utime, &stime) != 2) {
+            continue;
+        }
+
+        secs += (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+    }
+
+    closedir(dir);
+    return secs;
 }
 
 static void iogen_print_stats(struct iogen *g,
                               struct rusage *start_rusage,
                               struct rusage *finish_rusage,
                               struct timespec *start_time,
-                              struct timespec *finish_time)
+                              struct timespec *finish_time,
+                              double sqpoll_secs)
 {
     double duration_secs;
     double cpu_secs;
     double rtps;
     double rtpcs;
+    struct histogram *h = &g->latency_ns;
+    double cswpr;
 
     duration_secs = finish_time->tv_sec + finish_time->tv_nsec / 1000000000.0 -
                     (start_time->tv_sec + start_time->tv_nsec / 1000000000.0);
@@ -90,52 +304,716 @@ static void iogen_print_stats(struct iogen *g,
                 start_rusage->ru_stime.tv_usec / 1000000.0);
     rtpcs = g->num_ios / cpu_secs;
 
-    printf("Duration (s),Total Roundtrips,Roundtrips/sec,CPU usage (s),Roundtrips/cpusec\n");
-    printf("%g,%lu,%g,%g,%g\n", duration_secs, g->num_ios, rtps, cpu_secs, rtpcs);
+    /* Voluntary and involuntary context switches across all threads */
+    cswpr = (double)(finish_rusage->ru_nvcsw + finish_rusage->ru_nivcsw -
+                     start_rusage->ru_nvcsw - start_rusage->ru_nivcsw) /
+            g->num_ios;
+
+    printf("Duration (s),Total Roundtrips,Roundtrips/sec,CPU usage (s),Roundtrips/cpusec,Mean latency (us),Context switches/roundtrip,Latency p50 (us),Latency p90 (us),Latency p99 (us),Latency p99.9 (us),Latency max (us),Max RSS (KiB)");
+    if (g->sqpoll) {
+        printf(",SQ poll CPU usage (s)");
+    }
+    if (g->num_threads > 1) {
+        printf(",Generators");
+    }
+    if (g->queue_depth > 1) {
+        printf(",Queue depth");
+    }
+    if (g->burst > 1) {
+        printf(",Burst");
+    }
+    if (g->churn_rate) {
+        printf(",Churned fds");
+    }
+    if (g->rate) {
+        printf(",Offered rate (msgs/s),Messages sent");
+    }
+    printf("\n");
+
+    printf("%g,%lu,%g,%g,%g,%g,%g,%g,%g,%g,%g,%g,%ld", duration_secs, g->num_ios, rtps,
+           cpu_secs, rtpcs,
+           histogram_mean(h) / 1000.0,
+           cswpr,
+           histogram_percentile(h, 50) / 1000.0,
+           histogram_percentile(h, 90) / 1000.0,
+           histogram_percentile(h, 99) / 1000.0,
+           histogram_percentile(h, 99.9) / 1000.0,
+           h->max / 1000.0,
+           finish_rusage->ru_maxrss);
+    if (g->sqpoll) {
+        printf(",%g", sqpoll_secs);
+    }
+    if (g->num_threads > 1) {
+        printf(",%d", g->num_threads);
+    }
+    if (g->queue_depth > 1) {
+        printf(",%d", g->queue_depth);
+    }
+    if (g->burst > 1) {
+        printf(",%d", g->burst);
+    }
+    if (g->churn_rate) {
+        printf(",%lu", g->num_churned);
+    }
+    if (g->rate) {
+        printf(",%lu,%lu", g->rate, g->num_sent);
+    }
+    printf("\n");
 }
 
-void iogen_run(struct iogen *g, volatile bool *stop)
+/* Read a whole message, the stream socket may return it in pieces */
+static bool iogen_read_msg(int fd, uint8_t *buf, size_t size)
 {
-    struct rusage start_rusage;
-    struct rusage finish_rusage;
-    struct timespec start_time;
-    struct timespec finish_time;
-    int fd = 0;
+    while (size > 0) {
+        ssize_t ret = read(fd, buf, size);
 
-    getrusage(RUSAGE_SELF, &start_rusage);
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+        if (ret <= 0) {
+            fprintf(stderr, "Read failed ret %zd errno %d\n", ret, errno);
+            return false;
+        }
 
-    while (!*stop) {
-        ssize_t ret;
+        buf += ret;
+        size -= ret;
+    }
+    return true;
+}
+
+/*
+ * Close a connection and open a new one in its place. The fd must not have a
+ * message in flight. Engine instances monitoring it are updated first.
+ */
+static bool iogen_replace_fd(struct iogen_thread *t, int index)
+{
+    struct iogen *g = t->g;
+    int i = t->fds - g->iogen_fds + index; /* index into all fds */
+    int first = 0;
+    int step = 1;
+
+    /* create_engines() deals sharded fds round-robin */
+    if (g->fd_distribution == FD_DISTRIBUTION_SHARDED) {
+        first = i % g->num_engines;
+        step = g->num_engines;
+    }
+
+    for (int j = first; j < g->num_engines; j += step) {
+        struct engine *e = g->engines[j];
+
+        if (!e->ops->remove_fd(e, g->engine_fds[i])) {
+            fprintf(stderr, "Failed to remove fd from engine\n");
+            return false;
+        }
+    }
+
+    close(g->engine_fds[i]);
+    close(g->iogen_fds[i]);
+
+    if (!iogen_open_fd(g, i)) {
+        fprintf(stderr, "socketpair failed\n");
+        return false;
+    }
+
+    for (int j = first; j < g->num_engines; j += step) {
+        struct engine *e = g->engines[j];
+
+        if (!e->ops->add_fd(e, g->engine_fds[i])) {
+            fprintf(stderr, "Failed to add fd to engine\n");
+            return false;
+        }
+    }
+
+    t->num_churned++;
+    return true;
+}
+
+/* Replace random connections that are due, no message may be in flight */
+static bool iogen_churn(struct iogen_thread *t)
+{
+    int64_t now_ns;
+
+    if (!t->churn_rate) {
+        return true;
+    }
+
+    now_ns = get_ns();
+    while (t->next_churn_ns <= now_ns && !*t->stop) {
         int32_t r;
 
-        ret = write(g->iogen_fds[fd], g->msgbuf, g->msg_size);
-        if (*stop) { /* Expected EINTR */
+        random_r(&t->random_buf, &r);
+        if (!iogen_replace_fd(t, r % t->num_fds)) {
+            return false;
+        }
+
+        t->next_churn_ns += 1000000000LL / t->churn_rate;
+    }
+    return true;
+}
+
+/* Pick the index of the next fd in this generator's slice */
+static int iogen_next_fd(struct iogen_thread *t, int fd)
+{
+    int32_t r;
+
+    switch (t->g->fd_model) {
+    case FD_MODEL_ZIPF:
+    case FD_MODEL_HOTSET:
+        return alias_table_sample(&t->fd_table, &t->random_buf);
+
+    case FD_MODEL_SEQUENTIAL:
+        return (fd + 1) % t->num_fds;
+
+    default:
+        random_r(&t->random_buf, &r);
+        return r % t->num_fds;
+    }
+}
+
+/* Send a message and wait for the reply before sending the next one */
+static void iogen_run_closed_loop(struct iogen_thread *t)
+{
+    size_t msg_size = t->g->msg_size;
+    int fd = 0;
+
+    while (!*t->stop) {
+        int64_t start_ns;
+        ssize_t ret;
+
+        if (!iogen_churn(t)) {
+            break;
+        }
+
+        start_ns = get_ns();
+
+        ret = write(t->fds[fd], t->msgbuf, msg_size);
+        if (*t->stop) { /* Expected EINTR */
             break;
         }
-        if (ret != (ssize_t)g->msg_size) {
+        if (ret != (ssize_t)msg_size) {
             fprintf(stderr, "Write failed ret %zd errno %d\n", ret, errno);
             break;
         }
 
-        ret = read(g->iogen_fds[fd], g->msgbuf, g->msg_size);
-        if (*stop) { /* Expected EINTR */
+        ret = read(t->fds[fd], t->msgbuf, msg_size);
+        if (*t->stop) { /* Expected EINTR */
             break;
         }
-        if (ret != (ssize_t)g->msg_size) {
+        if (ret != (ssize_t)msg_size) {
             fprintf(stderr, "Read failed ret %zd errno %d\n", ret, errno);
             break;
         }
 
-        g->num_ios++;
+        histogram_add(&t->latency_ns, get_ns() - start_ns);
+        t->num_ios++;
+
+        fd = iogen_next_fd(t, fd);
+    }
+}
+
+/* Fds with no message in flight */
+struct iogen_idle {
+    int *slots; /* indices of idle fds */
+    int *pos; /* slot of each fd, or -1 while in flight */
+    int count;
+    int last; /* most recently picked fd */
+};
+
+static void iogen_idle_put(struct iogen_idle *idle, int i)
+{
+    idle->pos[i] = idle->count;
+    idle->slots[idle->count++] = i;
+}
+
+static void iogen_idle_take(struct iogen_idle *idle, int i)
+{
+    int slot = idle->pos[i];
+    int moved = idle->slots[--idle->count];
+
+    idle->slots[slot] = moved;
+    idle->pos[moved] = slot;
+    idle->pos[i] = -1;
+}
+
+/*
+ * Take an idle fd picked by the fd model. If the pick already has a message
+ * in flight, a random idle fd is used instead.
+ */
+static int iogen_pick_idle(struct iogen_thread *t, struct iogen_idle *idle)
+{
+    int i;
+
+    i = iogen_next_fd(t, idle->last);
+    if (idle->pos[i] < 0) {
+        int32_t r;
+
+        random_r(&t->random_buf, &r);
+        i = idle->slots[r % idle->count];
+    }
+
+    iogen_idle_take(idle, i);
+    idle->last = i;
+    return i;
+}
+
+/* Send a message on an idle fd */
+static bool iogen_send_idle(struct iogen_thread *t, struct iogen_idle *idle,
+                            int64_t *send_ns)
+{
+    size_t msg_size = t->g->msg_size;
+    ssize_t ret;
+    int i;
+
+    i = iogen_pick_idle(t, idle);
+    send_ns[i] = get_ns();
+
+    /* Never blocks since this fd has no other message in flight */
+    ret = write(t->fds[i], t->msgbuf, msg_size);
+    if (ret != (ssize_t)msg_size) {
+        fprintf(stderr, "Write failed ret %zd errno %d\n", ret, errno);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Keep queue_depth messages in flight on distinct fds. Each reply frees its
+ * fd and the next message goes to an idle fd, which may be the same one.
+ */
+static void iogen_run_pipelined(struct iogen_thread *t)
+{
+    struct epoll_event events[64];
+    struct iogen_idle idle = {
+        .last = -1,
+    };
+    int64_t *send_ns;
+    int epfd;
+
+    send_ns = calloc(t->num_fds, sizeof(send_ns[0]));
+    idle.slots = calloc(t->num_fds, sizeof(idle.slots[0]));
+    idle.pos = calloc(t->num_fds, sizeof(idle.pos[0]));
+    if (!send_ns || !idle.slots || !idle.pos) {
+        fprintf(stderr, "Out of memory\n");
+        goto out_free;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        fprintf(stderr, "epoll_create1 failed\n");
+        goto out_free;
+    }
+
+    for (int i = 0; i < t->num_fds; i++) {
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.u32 = i,
+        };
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, t->fds[i], &event) < 0) {
+            fprintf(stderr, "epoll_ctl failed\n");
+            goto out_close_epfd;
+        }
+        iogen_idle_put(&idle, i);
+    }
+
+    for (int i = 0; i < t->g->queue_depth; i++) {
+        if (!iogen_send_idle(t, &idle, send_ns)) {
+            goto out_close_epfd;
+        }
+    }
+
+    while (!*t->stop) {
+        int n = epoll_wait(epfd, events, 64, -1);
+
+        for (int i = 0; i < n; i++) {
+            int index = events[i].data.u32;
+
+            if (!iogen_read_msg(t->fds[index], t->msgbuf, t->g->msg_size)) {
+                goto out_close_epfd;
+            }
+
+            histogram_add(&t->latency_ns, get_ns() - send_ns[index]);
+            t->num_ios++;
+
+            iogen_idle_put(&idle, index);
+            if (!iogen_send_idle(t, &idle, send_ns)) {
+                goto out_close_epfd;
+            }
+        }
+    }
+
+out_close_epfd:
+    close(epfd);
+out_free:
+    free(idle.pos);
+    free(idle.slots);
+    free(send_ns);
+}
+
+/*
+ * Write to burst distinct fds back-to-back before collecting any replies, so
+ * that each engine wait can find that many fds ready at once.
+ */
+static void iogen_run_burst(struct iogen_thread *t)
+{
+    size_t msg_size = t->g->msg_size;
+    int burst = t->g->burst;
+    struct iogen_idle idle = {
+        .last = -1,
+    };
+    int64_t *send_ns;
+    int *burst_fds;
+
+    send_ns = calloc(burst, sizeof(send_ns[0]));
+    burst_fds = calloc(burst, sizeof(burst_fds[0]));
+    idle.slots = calloc(t->num_fds, sizeof(idle.slots[0]));
+    idle.pos = calloc(t->num_fds, sizeof(idle.pos[0]));
+    if (!send_ns || !burst_fds || !idle.slots || !idle.pos) {
+        fprintf(stderr, "Out of memory\n");
+        goto out;
+    }
+
+    for (int i = 0; i < t->num_fds; i++) {
+        iogen_idle_put(&idle, i);
+    }
+
+    while (!*t->stop) {
+        if (!iogen_churn(t)) {
+            goto out;
+        }
+
+        for (int k = 0; k < burst; k++) {
+            ssize_t ret;
+            int i = iogen_pick_idle(t, &idle);
+
+            burst_fds[k] = i;
+            send_ns[k] = get_ns();
+
+            ret = write(t->fds[i], t->msgbuf, msg_size);
+            if (*t->stop) { /* Expected EINTR */
+                goto out;
+            }
+            if (ret != (ssize_t)msg_size) {
+                fprintf(stderr, "Write failed ret %zd errno %d\n", ret, errno);
+                goto out;
+            }
+        }
+
+        for (int k = 0; k < burst; k++) {
+            ssize_t ret;
+            int i = burst_fds[k];
+
+            ret = read(t->fds[i], t->msgbuf, msg_size);
+            if (*t->stop) { /* Expected EINTR */
+                goto out;
+            }
+            if (ret != (ssize_t)msg_size) {
+                fprintf(stderr, "Read failed ret %zd errno %d\n", ret, errno);
+                goto out;
+            }
+
+            histogram_add(&t->latency_ns, get_ns() - send_ns[k]);
+            t->num_ios++;
+
+            iogen_idle_put(&idle, i);
+        }
+    }
+
+out:
+    free(idle.pos);
+    free(idle.slots);
+    free(burst_fds);
+    free(send_ns);
+}
+
+/* Open-loop replies are collected by a separate thread */
+struct iogen_receiver {
+    struct iogen_thread *t;
+    pthread_t thread;
+    uint8_t *msgbuf;
+    int epfd;
+    int efd; /* the eventfd */
+};
+
+static void *iogen_receiver_thread(void *opaque)
+{
+    struct iogen_receiver *rx = opaque;
+    struct iogen_thread *t = rx->t;
+    struct epoll_event events[64];
+
+    for (;;) {
+        int n = epoll_wait(rx->epfd, events, 64, -1);
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            int64_t send_ns;
+
+            /* Stop thread */
+            if (fd == rx->efd) {
+                return NULL;
+            }
+
+            if (!iogen_read_msg(fd, rx->msgbuf, t->g->msg_size)) {
+                return NULL;
+            }
+
+            /* Latency counts from the intended send time */
+            memcpy(&send_ns, rx->msgbuf, sizeof(send_ns));
+            histogram_add(&t->latency_ns, get_ns() - send_ns);
+            t->num_ios++;
+        }
+    }
+
+    return NULL;
+}
+
+/* Create a thread with all signals blocked, only the main thread handles them */
+static int iogen_thread_create(pthread_t *thread,
+                               void *(*fn)(void *),
+                               void *opaque)
+{
+    sigset_t mask;
+    sigset_t old_mask;
+    int ret;
+
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    ret = pthread_create(thread, NULL, fn, opaque);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return ret;
+}
+
+static bool iogen_receiver_start(struct iogen_receiver *rx,
+                                 struct iogen_thread *t)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN,
+    };
+
+    rx->t = t;
+
+    rx->msgbuf = calloc(1, t->g->msg_size);
+    if (!rx->msgbuf) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    rx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (rx->epfd < 0) {
+        fprintf(stderr, "epoll_create1 failed\n");
+        goto err_free_msgbuf;
+    }
+
+    /* The eventfd is used to tell the thread to stop */
+    rx->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (rx->efd < 0) {
+        fprintf(stderr, "Eventfd creation failed\n");
+        goto err_close_epfd;
+    }
+
+    event.data.fd = rx->efd;
+    if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, rx->efd, &event) < 0) {
+        fprintf(stderr, "epoll_ctl failed\n");
+        goto err_close_efd;
+    }
+
+    for (int i = 0; i < t->num_fds; i++) {
+        event.data.fd = t->fds[i];
+        if (epoll_ctl(rx->epfd, EPOLL_CTL_ADD, t->fds[i], &event) < 0) {
+            fprintf(stderr, "epoll_ctl failed\n");
+            goto err_close_efd;
+        }
+    }
+
+    if (iogen_thread_create(&rx->thread, iogen_receiver_thread, rx) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        goto err_close_efd;
+    }
+    return true;
+
+err_close_efd:
+    close(rx->efd);
+err_close_epfd:
+    close(rx->epfd);
+err_free_msgbuf:
+    free(rx->msgbuf);
+    return false;
+}
+
+static void iogen_receiver_stop(struct iogen_receiver *rx)
+{
+    uint64_t eventfd_val = 1;
+
+    write(rx->efd, &eventfd_val, sizeof(eventfd_val));
+    pthread_join(rx->thread, NULL);
+
+    close(rx->efd);
+    close(rx->epfd);
+    free(rx->msgbuf);
+}
+
+/* Return the time until the next open-loop send */
+static int64_t iogen_interarrival_ns(struct iogen_thread *t)
+{
+    int32_t r;
+
+    if (t->g->arrival == ARRIVAL_CONSTANT) {
+        return 1000000000LL / t->rate;
+    }
+
+    /* Exponential distribution, u is uniform in (0, 1) */
+    random_r(&t->random_buf, &r);
+    return -log((r + 1.0) / (RAND_MAX + 2.0)) * 1000000000.0 / t->rate;
+}
+
+/*
+ * Send messages on a schedule regardless of replies. When the sender falls
+ * behind it catches up without skipping sends and each message carries its
+ * intended send time, so queueing delay is not hidden by coordinated omission.
+ */
+static void iogen_run_open_loop(struct iogen_thread *t)
+{
+    size_t msg_size = t->g->msg_size;
+    struct iogen_receiver rx;
+    int64_t send_ns;
+    int fd = 0;
+
+    if (!iogen_receiver_start(&rx, t)) {
+        return;
+    }
+
+    send_ns = get_ns();
+
+    while (!*t->stop) {
+        struct timespec ts = {
+            .tv_sec = send_ns / 1000000000,
+            .tv_nsec = send_ns % 1000000000,
+        };
+        ssize_t ret;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (*t->stop) { /* Expected EINTR */
+            break;
+        }
+
+        memcpy(t->msgbuf, &send_ns, sizeof(send_ns));
+
+        ret = write(t->fds[fd], t->msgbuf, msg_size);
+        if (*t->stop) { /* Expected EINTR */
+            break;
+        }
+        if (ret != (ssize_t)msg_size) {
+            fprintf(stderr, "Write failed ret %zd errno %d\n", ret, errno);
+            break;
+        }
+
+        t->num_sent++;
+        send_ns += iogen_interarrival_ns(t);
 
-        random_r(&g->random_buf, &r);
-        fd = r % g->num_fds;
+        fd = iogen_next_fd(t, fd);
+    }
+
+    iogen_receiver_stop(&rx);
+}
+
+static void *iogen_thread_fn(void *opaque)
+{
+    struct iogen_thread *t = opaque;
+
+    if (t->startup_semaphore) {
+        /* Wait until the number of generators is known */
+        while (sem_wait(t->startup_semaphore) < 0 && errno == EINTR) {
+            /* nothing */
+        }
+    }
+
+    /* All generators start sending together */
+    pthread_barrier_wait(t->barrier);
+
+    if (t->churn_rate) {
+        t->next_churn_ns = get_ns() + 1000000000LL / t->churn_rate;
+    }
+
+    if (t->rate) {
+        iogen_run_open_loop(t);
+    } else if (t->g->burst > 1) {
+        iogen_run_burst(t);
+    } else if (t->g->queue_depth > 1) {
+        iogen_run_pipelined(t);
+    } else {
+        iogen_run_closed_loop(t);
+    }
+    return NULL;
+}
+
+void iogen_run(struct iogen *g, volatile bool *stop)
+{
+    struct rusage start_rusage;
+    struct rusage finish_rusage;
+    struct timespec start_time;
+    struct timespec finish_time;
+    pthread_barrier_t barrier;
+    sem_t startup_semaphore;
+    double sqpoll_secs = 0;
+    int num_started;
+
+    sem_init(&startup_semaphore, 0, 0);
+
+    for (int i = 0; i < g->num_threads; i++) {
+        g->threads[i].barrier = &barrier;
+        g->threads[i].startup_semaphore = i > 0 ? &startup_semaphore : NULL;
+        g->threads[i].stop = stop;
+    }
+
+    /*
+     * The first generator runs in this thread so SIGALRM interrupts it, the
+     * others notice the stop flag after their current roundtrip.
+     */
+    for (num_started = 1; num_started < g->num_threads; num_started++) {
+        struct iogen_thread *t = &g->threads[num_started];
+
+        if (iogen_thread_create(&t->thread, iogen_thread_fn, t) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            *stop = true;
+            break;
+        }
+    }
+
+    /* The barrier only counts generators that actually exist */
+    pthread_barrier_init(&barrier, NULL, num_started);
+    for (int i = 1; i < num_started; i++) {
+        sem_post(&startup_semaphore);
+    }
+
+    if (g->sqpoll) {
+        sqpoll_secs = -sqpoll_cpu_secs();
+    }
+
+    getrusage(RUSAGE_SELF, &start_rusage);
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    iogen_thread_fn(&g->threads[0]);
+
+    for (int i = 1; i < num_started; i++) {
+        pthread_join(g->threads[i].thread, NULL);
     }
 
     clock_gettime(CLOCK_MONOTONIC, &finish_time);
     getrusage(RUSAGE_SELF, &finish_rusage);
 
+    if (g->sqpoll) {
+        sqpoll_secs += sqpoll_cpu_secs();
+    }
+
+    pthread_barrier_destroy(&barrier);
+    sem_destroy(&startup_semaphore);
+
+    for (int i = 0; i < num_started; i++) {
+        struct iogen_thread *t = &g->threads[i];
+
+        g->num_sent += t->num_sent;
+        g->num_churned += t->num_churned;
+        g->num_ios += t->num_ios;
+        histogram_merge(&g->latency_ns, &t->latency_ns);
+    }
+
     iogen_print_stats(g, &start_rusage, &finish_rusage,
-                      &start_time, &finish_time);
+                      &start_time, &finish_time, sqpoll_secs);
 }
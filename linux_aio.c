@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Linux native AIO with IOCB_CMD_POLL (Linux 4.18+). glibc has no wrappers for
+ * the io_*(2) syscalls and libaio is not needed for this, so invoke them
+ * directly.
+ *
+ * Poll iocbs are one-shot, so each fd's iocb is resubmitted after its message
+ * has been echoed. Resubmissions from one io_getevents() batch are combined
+ * into a single io_submit().
+ */
+#include <linux/aio_abi.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "fdmonbench.h"
+
+struct linux_aio_engine {
+    struct engine engine;
+    pthread_t thread;
+    uint8_t *msgbuf;
+    size_t msg_size;
+    sem_t startup_semaphore;
+    aio_context_t ctx;
+    int efd; /* the eventfd */
+
+    /* iocbs[0] polls the eventfd, the rest poll fds in order */
+    struct iocb *iocbs;
+    struct iocb **submit_iocbs;
+    struct io_event *events;
+    int num_iocbs;
+
+    /* Statistics */
+    unsigned long num_submits;
+    struct histogram events_per_wait;
+    struct engine_stats stats;
+};
+
+static int sys_io_setup(unsigned nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                            struct io_event *events,
+                            struct timespec *timeout)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static void *linux_aio_thread(void *opaque)
+{
+    struct linux_aio_engine *pe = opaque;
+
+    /* Ready! */
+    sem_post(&pe->startup_semaphore);
+
+    for (;;) {
+        int num_submit = 0;
+        int ret;
+
+        ret = sys_io_getevents(pe->ctx, 1, pe->num_iocbs, pe->events, NULL);
+        if (ret >= 0) {
+            histogram_add(&pe->events_per_wait, ret);
+        }
+        if (ret > 0) {
+            pe->stats.wakeups++;
+        }
+
+        for (int i = 0; i < ret; i++) {
+            struct io_event *event = &pe->events[i];
+            struct iocb *iocb = &pe->iocbs[event->data];
+            int fd = iocb->aio_fildes;
+
+            /* Handle our eventfd */
+            if (fd == pe->efd) {
+                /* Stop thread */
+                return NULL;
+            }
+
+            pe->stats.events++;
+
+            if (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) <= 0) {
+                pe->stats.spurious++;
+            }
+
+            pe->submit_iocbs[num_submit++] = iocb;
+        }
+
+        if (num_submit > 0) {
+            sys_io_submit(pe->ctx, num_submit, pe->submit_iocbs);
+            pe->num_submits++;
+        }
+    }
+
+    return NULL;
+}
+
+static struct engine *linux_aio_create(const struct options *opts,
+                                       int *fds,
+                                       int num_fds,
+                                       char **errmsg)
+{
+    const char *err = NULL;
+    struct linux_aio_engine *pe;
+    int ret;
+
+    pe = malloc(sizeof(*pe));
+    if (!pe) {
+        *errmsg = strdup("Out of memory");
+        return NULL;
+    }
+
+    pe->engine.ops = &linux_aio_engine_ops;
+    pe->num_submits = 0;
+    histogram_init(&pe->events_per_wait);
+    memset(&pe->stats, 0, sizeof(pe->stats));
+
+    pe->msg_size = opts->msg_size;
+    pe->msgbuf = calloc(1, opts->msg_size);
+    if (!pe->msgbuf) {
+        err = "Out of memory";
+        goto err_free_pe;
+    }
+
+    pe->num_iocbs = num_fds + 1;
+
+    pe->iocbs = calloc(pe->num_iocbs, sizeof(pe->iocbs[0]));
+    if (!pe->iocbs) {
+        err = "Out of memory";
+        goto err_free_msgbuf;
+    }
+
+    pe->submit_iocbs = calloc(pe->num_iocbs, sizeof(pe->submit_iocbs[0]));
+    if (!pe->submit_iocbs) {
+        err = "Out of memory";
+        goto err_free_iocbs;
+    }
+
+    pe->events = calloc(pe->num_iocbs, sizeof(pe->events[0]));
+    if (!pe->events) {
+        err = "Out of memory";
+        goto err_free_submit_iocbs;
+    }
+
+    /* The eventfd is used to tell the thread to stop */
+    pe->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pe->efd < 0) {
+        err = "Eventfd creation failed";
+        goto err_free_events;
+    }
+
+    pe->ctx = 0;
+    if (sys_io_setup(pe->num_iocbs, &pe->ctx) < 0) {
+        err = "io_setup failed";
+        goto err_close_efd;
+    }
+
+    for (int i = 0; i < pe->num_iocbs; i++) {
+        struct iocb *iocb = &pe->iocbs[i];
+
+        iocb->aio_lio_opcode = IOCB_CMD_POLL;
+        iocb->aio_fildes = i == 0 ? pe->efd : fds[i - 1];
+        iocb->aio_buf = POLLIN;
+        iocb->aio_data = i;
+
+        pe->submit_iocbs[i] = iocb;
+    }
+
+    ret = sys_io_submit(pe->ctx, pe->num_iocbs, pe->submit_iocbs);
+    if (ret != pe->num_iocbs) {
+        err = "io_submit IOCB_CMD_POLL failed";
+        goto err_io_destroy;
+    }
+
+    /* The semaphore is used to wait for the thread to become ready */
+    if (sem_init(&pe->startup_semaphore, 0, 0) < 0) {
+        err = "Failed to create startup semaphore";
+        goto err_io_destroy;
+    }
+
+    /* Start thread */
+    if (pthread_create(&pe->thread, NULL, linux_aio_thread, pe) != 0) {
+        err = "pthread_create failed";
+        goto err_sem_destroy;
+    }
+
+    /* Wait for thread to become ready */
+    do {
+        ret = sem_wait(&pe->startup_semaphore);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret < 0) {
+        err = "sem_wait failed";
+        goto err_pthread_join;
+    }
+
+    return &pe->engine;
+
+err_pthread_join:
+    pthread_join(pe->thread, NULL);
+err_sem_destroy:
+    sem_destroy(&pe->startup_semaphore);
+err_io_destroy:
+    sys_io_destroy(pe->ctx);
+err_close_efd:
+    close(pe->efd);
+err_free_events:
+    free(pe->events);
+err_free_submit_iocbs:
+    free(pe->submit_iocbs);
+err_free_iocbs:
+    free(pe->iocbs);
+err_free_msgbuf:
+    free(pe->msgbuf);
+err_free_pe:
+    free(pe);
+    *errmsg = strdup(err);
+    return NULL;
+}
+
+static void linux_aio_destroy(struct engine *e)
+{
+    struct linux_aio_engine *pe = (struct linux_aio_engine *)e;
+    uint64_t eventfd_val = 1;
+
+    write(pe->efd, &eventfd_val, sizeof(eventfd_val));
+    pthread_join(pe->thread, NULL);
+
+    sem_destroy(&pe->startup_semaphore);
+
+    /* This also cancels the outstanding poll iocbs */
+    sys_io_destroy(pe->ctx);
+    close(pe->efd);
+    free(pe->events);
+    free(pe->submit_iocbs);
+    free(pe->iocbs);
+    free(pe->msgbuf);
+    free(pe);
+}
+
+static void linux_aio_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct linux_aio_engine *pe = (struct linux_aio_engine *)e;
+
+    *stats = pe->stats;
+}
+
+static void linux_aio_print_stats(struct engine *e,
+                                  int index,
+                                  unsigned long num_ios)
+{
+    struct linux_aio_engine *pe = (struct linux_aio_engine *)e;
+    struct histogram *h = &pe->events_per_wait;
+
+    if (index == 0) {
+        printf("Engine,Submits,Submits/roundtrip,Events/wait,Events/wait p50,Events/wait p99,Events/wait max\n");
+    }
+    printf("%d,%lu,%g,%g,%lu,%lu,%lu\n", index, pe->num_submits,
+           (double)pe->num_submits / num_ios,
+           histogram_mean(h),
+           (unsigned long)histogram_percentile(h, 50),
+           (unsigned long)histogram_percentile(h, 99),
+           (unsigned long)h->max);
+}
+
+const struct engine_ops linux_aio_engine_ops = {
+    .name = "linux-aio",
+    .create = linux_aio_create,
+    .destroy = linux_aio_destroy,
+    .print_stats = linux_aio_print_stats,
+    .get_stats = linux_aio_get_stats,
+};
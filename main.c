@@ -7,19 +7,55 @@ enum {
     OPTION_ENGINE = 256,
     OPTION_NUM_ENGINES,
     OPTION_NUM_FDS,
+    OPTION_FD_DISTRIBUTION,
+    OPTION_FD_DISTRIBUTION_MODEL,
     OPTION_MSG_SIZE,
     OPTION_EXCLUSIVE,
+    OPTION_MAX_EVENTS,
+    OPTION_POLL_MAX_NS,
+    OPTION_THREADS_POOL_SIZE,
+    OPTION_NUM_WORKERS,
+    OPTION_RATE,
+    OPTION_QUEUE_DEPTH,
+    OPTION_NUM_GENERATORS,
+    OPTION_BURST,
+    OPTION_CHURN_RATE,
+    OPTION_ARRIVAL,
     OPTION_DURATION_SECS,
+    OPTION_IO_URING_BUF_RING_SIZE,
+    OPTION_IO_URING_FIXED,
+    OPTION_IO_URING_SETUP,
+    OPTION_IO_URING_SQPOLL,
+    OPTION_IO_URING_SQ_THREAD_CPU,
+    OPTION_IO_URING_SQ_THREAD_IDLE_MS,
 };
 
 static const struct option longopts[] = {
+    {"arrival", required_argument, NULL, OPTION_ARRIVAL},
+    {"burst", required_argument, NULL, OPTION_BURST},
+    {"churn-rate", required_argument, NULL, OPTION_CHURN_RATE},
     {"duration-secs", required_argument, NULL, OPTION_DURATION_SECS},
     {"engine", required_argument, NULL, OPTION_ENGINE},
     {"exclusive", required_argument, NULL, OPTION_EXCLUSIVE},
+    {"fd-distribution", required_argument, NULL, OPTION_FD_DISTRIBUTION},
+    {"fd-distribution-model", required_argument, NULL, OPTION_FD_DISTRIBUTION_MODEL},
     {"help", no_argument, NULL, '?'},
+    {"io-uring-buf-ring-size", required_argument, NULL, OPTION_IO_URING_BUF_RING_SIZE},
+    {"io-uring-fixed", required_argument, NULL, OPTION_IO_URING_FIXED},
+    {"io-uring-setup", required_argument, NULL, OPTION_IO_URING_SETUP},
+    {"io-uring-sq-thread-cpu", required_argument, NULL, OPTION_IO_URING_SQ_THREAD_CPU},
+    {"io-uring-sq-thread-idle-ms", required_argument, NULL, OPTION_IO_URING_SQ_THREAD_IDLE_MS},
+    {"io-uring-sqpoll", required_argument, NULL, OPTION_IO_URING_SQPOLL},
+    {"max-events", required_argument, NULL, OPTION_MAX_EVENTS},
     {"msg-size", required_argument, NULL, OPTION_MSG_SIZE},
     {"num-engines", required_argument, NULL, OPTION_NUM_ENGINES},
     {"num-fds", required_argument, NULL, OPTION_NUM_FDS},
+    {"num-generators", required_argument, NULL, OPTION_NUM_GENERATORS},
+    {"num-workers", required_argument, NULL, OPTION_NUM_WORKERS},
+    {"poll-max-ns", required_argument, NULL, OPTION_POLL_MAX_NS},
+    {"queue-depth", required_argument, NULL, OPTION_QUEUE_DEPTH},
+    {"rate", required_argument, NULL, OPTION_RATE},
+    {"threads-pool-size", required_argument, NULL, OPTION_THREADS_POOL_SIZE},
     {NULL, 0, NULL, 0},
 };
 
@@ -28,37 +64,176 @@ static void usage(const char *argv0)
     fprintf(stderr, "Usage: %s [OPTION]...\n", argv0);
     fprintf(stderr, "Perform file descriptor monitoring benchmarking.\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "  --arrival=constant|poisson\n");
+    fprintf(stderr, "                         open-loop inter-arrival times (default: constant)\n");
+    fprintf(stderr, "  --burst=<int>          write to this many fds before reading the replies\n");
+    fprintf(stderr, "                         (default: 1)\n");
+    fprintf(stderr, "  --churn-rate=<int>     replace this many connections per second\n");
+    fprintf(stderr, "                         (default: 0)\n");
     fprintf(stderr, "  --duration-secs=<int>  run for number of seconds (default: 30)\n");
-    fprintf(stderr, "  --engine=epoll|io_uring|io_uring-aio|poll|select|threads\n");
+    fprintf(stderr, "  --engine=epoll|epoll-et|epoll-lf|epoll-oneshot|io_uring|\n");
+    fprintf(stderr, "           io_uring-aio|io_uring-link|io_uring-multishot|\n");
+    fprintf(stderr, "           io_uring-recv-multishot|linux-aio|poll|reactor|\n");
+    fprintf(stderr, "           select|sigio|spin|threads\n");
     fprintf(stderr, "                         set fd monitoring engine (default: select)\n");
     fprintf(stderr, "  --exclusive=0|1        use EPOLLEXCLUSIVE (default: 0)\n");
+    fprintf(stderr, "  --fd-distribution=shared|sharded\n");
+    fprintf(stderr, "                         monitor all fds in every engine or deal them\n");
+    fprintf(stderr, "                         round-robin to engines (default: shared)\n");
+    fprintf(stderr, "  --fd-distribution-model=uniform|zipf:<s>|hotset:<pct>:<prob>|sequential\n");
+    fprintf(stderr, "                         how the generator picks the next fd, hotset sends\n");
+    fprintf(stderr, "                         <prob>%% of messages to <pct>%% of fds (default: uniform)\n");
     fprintf(stderr, "  --help                 print this help\n");
+    fprintf(stderr, "  --io-uring-buf-ring-size=<int>\n");
+    fprintf(stderr, "                         number of provided buffers (default: 256)\n");
+    fprintf(stderr, "  --io-uring-fixed=files,buffers\n");
+    fprintf(stderr, "                         use registered files and/or buffers (default: none)\n");
+    fprintf(stderr, "  --io-uring-setup=single-issuer,defer-taskrun,coop-taskrun\n");
+    fprintf(stderr, "                         use io_uring setup flags if supported (default: none)\n");
+    fprintf(stderr, "  --io-uring-sq-thread-cpu=<int>\n");
+    fprintf(stderr, "                         pin the SQ poller thread to a CPU (default: unpinned)\n");
+    fprintf(stderr, "  --io-uring-sq-thread-idle-ms=<int>\n");
+    fprintf(stderr, "                         SQ poller thread idle time (default: kernel default)\n");
+    fprintf(stderr, "  --io-uring-sqpoll=0|1  use IORING_SETUP_SQPOLL (default: 0)\n");
+    fprintf(stderr, "  --max-events=<int>     epoll_wait(2) maxevents (default: 2)\n");
     fprintf(stderr, "  --msg-size             number of bytes per message (default: 1)\n");
     fprintf(stderr, "  --num-engines          number of engine instances (default: 1)\n");
     fprintf(stderr, "  --num-fds              number of file descriptors (default: 1)\n");
+    fprintf(stderr, "  --num-generators=<int> number of generator threads, each with its own\n");
+    fprintf(stderr, "                         slice of the fds (default: 1)\n");
+    fprintf(stderr, "  --num-workers=<int>    number of reactor worker threads (default: 1)\n");
+    fprintf(stderr, "  --poll-max-ns=<int>    maximum adaptive polling time (default: 0)\n");
+    fprintf(stderr, "  --queue-depth=<int>    closed-loop messages in flight on distinct fds\n");
+    fprintf(stderr, "                         (default: 1)\n");
+    fprintf(stderr, "  --rate=<int>           open-loop messages per second, 0 waits for each\n");
+    fprintf(stderr, "                         reply before sending the next (default: 0)\n");
+    fprintf(stderr, "  --threads-pool-size=<int>\n");
+    fprintf(stderr, "                         number of worker threads (default: one per fd)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "This program is released under the GNU General Public License v3.0 or later.\n");
 }
 
+/*
+ * Parse a comma-separated list of names into a bitmask. Bit i corresponds to
+ * names[i]. Returns false if an unknown name is encountered.
+ */
+static bool parse_name_list(const char *arg,
+                            const char * const *names,
+                            unsigned *mask)
+{
+    *mask = 0;
+
+    while (*arg) {
+        size_t len = strcspn(arg, ",");
+        int i;
+
+        for (i = 0; names[i]; i++) {
+            if (strlen(names[i]) == len && strncmp(arg, names[i], len) == 0) {
+                break;
+            }
+        }
+
+        if (!names[i]) {
+            return false;
+        }
+
+        *mask |= 1u << i;
+
+        arg += len;
+        if (*arg == ',') {
+            arg++;
+        }
+    }
+
+    return true;
+}
+
+/* Parse a percentage from 0 to 100 followed by terminator */
+static bool parse_percentage(const char *arg, char terminator,
+                             double *pct, char **endptr)
+{
+    *pct = strtod(arg, endptr);
+    return *endptr != arg && **endptr == terminator &&
+           *pct >= 0 && *pct <= 100;
+}
+
+/* Parse uniform, zipf:<s>, hotset:<pct>:<prob>, or sequential */
+static bool parse_fd_model(struct options *opts, const char *arg)
+{
+    char *end;
+
+    if (strcmp(arg, "uniform") == 0) {
+        opts->fd_model = FD_MODEL_UNIFORM;
+    } else if (strcmp(arg, "sequential") == 0) {
+        opts->fd_model = FD_MODEL_SEQUENTIAL;
+    } else if (strncmp(arg, "zipf:", 5) == 0) {
+        opts->fd_model = FD_MODEL_ZIPF;
+        opts->fd_model_zipf_s = strtod(arg + 5, &end);
+        if (end == arg + 5 || *end != '\0' || !(opts->fd_model_zipf_s > 0)) {
+            return false;
+        }
+    } else if (strncmp(arg, "hotset:", 7) == 0) {
+        opts->fd_model = FD_MODEL_HOTSET;
+        if (!parse_percentage(arg + 7, ':', &opts->fd_model_hot_pct, &end) ||
+            !parse_percentage(end + 1, '\0', &opts->fd_model_hot_prob, &end) ||
+            opts->fd_model_hot_pct == 0) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static bool parse_options(struct options *opts, int argc, char **argv)
 {
     const struct engine_ops *engines[] = {
         &epoll_engine_ops,
+        &epoll_et_engine_ops,
+        &epoll_lf_engine_ops,
+        &epoll_oneshot_engine_ops,
         &io_uring_aio_engine_ops,
         &io_uring_engine_ops,
+        &io_uring_link_engine_ops,
+        &io_uring_multishot_engine_ops,
+        &io_uring_recv_multishot_engine_ops,
+        &linux_aio_engine_ops,
         &poll_engine_ops,
+        &reactor_engine_ops,
         &select_engine_ops,
+        &sigio_engine_ops,
+        &spin_engine_ops,
         &threads_engine_ops,
         NULL,
     };
+    bool num_workers_set = false;
+    bool max_events_set = false;
 
     /* Set default option values */
     *opts = (struct options){
         .engine_ops = &select_engine_ops,
         .num_engines = 1,
         .num_fds = 1,
+        .fd_distribution = FD_DISTRIBUTION_SHARED,
         .msg_size = 1,
         .exclusive = false,
+        .max_events = 2,
+        .poll_max_ns = 0,
+        .io_uring_fixed = 0,
+        .io_uring_setup = 0,
+        .io_uring_sqpoll = false,
+        .io_uring_sq_thread_cpu = -1,
+        .io_uring_sq_thread_idle_ms = 0,
+        .io_uring_buf_ring_size = 256,
+        .threads_pool_size = 0,
+        .num_workers = 1,
+        .rate = 0,
+        .arrival = ARRIVAL_CONSTANT,
+        .queue_depth = 1,
+        .num_generators = 1,
+        .fd_model = FD_MODEL_UNIFORM,
+        .burst = 1,
+        .churn_rate = 0,
         .duration_secs = 30,
     };
 
@@ -137,6 +312,228 @@ static bool parse_options(struct options *opts, int argc, char **argv)
             }
             break;
 
+        case OPTION_FD_DISTRIBUTION:
+            if (strcmp(optarg, "shared") == 0) {
+                opts->fd_distribution = FD_DISTRIBUTION_SHARED;
+            } else if (strcmp(optarg, "sharded") == 0) {
+                opts->fd_distribution = FD_DISTRIBUTION_SHARDED;
+            } else {
+                fprintf(stderr, "The value of fd-distribution must be shared or sharded\n");
+                usage(argv[0]);
+                return false;
+            }
+            break;
+
+        case OPTION_FD_DISTRIBUTION_MODEL:
+            if (!parse_fd_model(opts, optarg)) {
+                fprintf(stderr, "Invalid fd-distribution-model value\n");
+                usage(argv[0]);
+                return false;
+            }
+            break;
+
+        case OPTION_IO_URING_BUF_RING_SIZE: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            /* The kernel limits buffer rings to 32768 entries */
+            if (ret == 0 || ret > 32768 || (ret & (ret - 1)) != 0) {
+                fprintf(stderr, "io-uring-buf-ring-size must be a power of 2 up to 32768\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->io_uring_buf_ring_size = ret;
+        } break;
+
+        case OPTION_IO_URING_FIXED: {
+            /* Order matches IO_URING_FIXED_* */
+            static const char * const names[] = {"files", "buffers", NULL};
+
+            if (strcmp(optarg, "none") != 0 &&
+                !parse_name_list(optarg, names, &opts->io_uring_fixed)) {
+                fprintf(stderr, "The value of io-uring-fixed must be a comma-separated list of files and buffers\n");
+                usage(argv[0]);
+                return false;
+            }
+        } break;
+
+        case OPTION_IO_URING_SETUP: {
+            /* Order matches IO_URING_SETUP_* */
+            static const char * const names[] = {
+                "single-issuer", "defer-taskrun", "coop-taskrun", NULL
+            };
+
+            if (strcmp(optarg, "none") != 0 &&
+                !parse_name_list(optarg, names, &opts->io_uring_setup)) {
+                fprintf(stderr, "The value of io-uring-setup must be a comma-separated list of single-issuer, defer-taskrun, and coop-taskrun\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            /* The kernel requires this combination */
+            if (opts->io_uring_setup & IO_URING_SETUP_DEFER_TASKRUN) {
+                opts->io_uring_setup |= IO_URING_SETUP_SINGLE_ISSUER;
+            }
+        } break;
+
+        case OPTION_IO_URING_SQPOLL:
+            if (strcmp(optarg, "0") == 0) {
+                opts->io_uring_sqpoll = false;
+            } else if (strcmp(optarg, "1") == 0) {
+                opts->io_uring_sqpoll = true;
+            } else {
+                fprintf(stderr, "The value of io-uring-sqpoll must be 0 or 1\n");
+                usage(argv[0]);
+                return false;
+            }
+            break;
+
+        case OPTION_IO_URING_SQ_THREAD_CPU: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX) {
+                fprintf(stderr, "Invalid io-uring-sq-thread-cpu value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->io_uring_sq_thread_cpu = ret;
+        } break;
+
+        case OPTION_IO_URING_SQ_THREAD_IDLE_MS: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)UINT_MAX) {
+                fprintf(stderr, "Invalid io-uring-sq-thread-idle-ms value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->io_uring_sq_thread_idle_ms = ret;
+        } break;
+
+        case OPTION_MAX_EVENTS: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid max-events value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->max_events = ret;
+            max_events_set = true;
+        } break;
+
+        case OPTION_POLL_MAX_NS: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT64_MAX) {
+                fprintf(stderr, "Invalid poll-max-ns value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->poll_max_ns = ret;
+        } break;
+
+        case OPTION_THREADS_POOL_SIZE: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid threads-pool-size value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->threads_pool_size = ret;
+        } break;
+
+        case OPTION_NUM_WORKERS: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid num-workers value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->num_workers = ret;
+            num_workers_set = true;
+        } break;
+
+        case OPTION_RATE: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > 1000000000) {
+                fprintf(stderr, "Invalid rate value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->rate = ret;
+        } break;
+
+        case OPTION_QUEUE_DEPTH: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid queue-depth value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->queue_depth = ret;
+        } break;
+
+        case OPTION_NUM_GENERATORS: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid num-generators value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->num_generators = ret;
+        } break;
+
+        case OPTION_BURST: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > (unsigned long)INT_MAX || ret == 0) {
+                fprintf(stderr, "Invalid burst value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->burst = ret;
+        } break;
+
+        case OPTION_CHURN_RATE: {
+            unsigned long ret = strtoul(optarg, NULL, 10);
+
+            if (ret > 1000000000) {
+                fprintf(stderr, "Invalid churn-rate value\n");
+                usage(argv[0]);
+                return false;
+            }
+
+            opts->churn_rate = ret;
+        } break;
+
+        case OPTION_ARRIVAL:
+            if (strcmp(optarg, "constant") == 0) {
+                opts->arrival = ARRIVAL_CONSTANT;
+            } else if (strcmp(optarg, "poisson") == 0) {
+                opts->arrival = ARRIVAL_POISSON;
+            } else {
+                fprintf(stderr, "The value of arrival must be constant or poisson\n");
+                usage(argv[0]);
+                return false;
+            }
+            break;
+
         case OPTION_DURATION_SECS: {
             unsigned long ret = strtoul(optarg, NULL, 10);
 
@@ -164,12 +561,113 @@ static bool parse_options(struct options *opts, int argc, char **argv)
         return false;
     }
 
+    if (opts->fd_distribution == FD_DISTRIBUTION_SHARDED &&
+        opts->num_fds < opts->num_engines) {
+        fprintf(stderr, "fd-distribution=sharded needs at least one fd per engine\n");
+        return false;
+    }
+
+    if (opts->num_generators > opts->num_fds) {
+        fprintf(stderr, "num-generators cannot exceed num-fds\n");
+        return false;
+    }
+
+    /* Every generator needs enough fds of its own */
+    if (opts->queue_depth > opts->num_fds / opts->num_generators) {
+        fprintf(stderr, "queue-depth cannot exceed num-fds / num-generators\n");
+        return false;
+    }
+
+    if (opts->rate && opts->rate < (unsigned long)opts->num_generators) {
+        fprintf(stderr, "rate must be at least num-generators\n");
+        return false;
+    }
+
+    if (opts->queue_depth > 1 && opts->rate) {
+        fprintf(stderr, "queue-depth cannot be combined with rate\n");
+        return false;
+    }
+
+    if (opts->burst > opts->num_fds / opts->num_generators) {
+        fprintf(stderr, "burst cannot exceed num-fds / num-generators\n");
+        return false;
+    }
+
+    if (opts->burst > 1 && (opts->queue_depth > 1 || opts->rate)) {
+        fprintf(stderr, "burst cannot be combined with queue-depth or rate\n");
+        return false;
+    }
+
+    if (opts->churn_rate && !opts->engine_ops->add_fd) {
+        fprintf(stderr, "%s engine does not support churn-rate\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if (opts->churn_rate &&
+        opts->churn_rate < (unsigned long)opts->num_generators) {
+        fprintf(stderr, "churn-rate must be at least num-generators\n");
+        return false;
+    }
+
+    /* Connections are only replaced while no message is in flight */
+    if (opts->churn_rate && (opts->queue_depth > 1 || opts->rate)) {
+        fprintf(stderr, "churn-rate cannot be combined with queue-depth or rate\n");
+        return false;
+    }
+
+    /* Open-loop messages carry their send timestamp */
+    if (opts->rate && opts->msg_size < sizeof(int64_t)) {
+        fprintf(stderr, "rate needs msg-size of at least %zu\n",
+                sizeof(int64_t));
+        return false;
+    }
+
     if (opts->exclusive && !opts->engine_ops->supports_exclusive) {
         fprintf(stderr, "%s engine does not support exclusive=1\n",
                 opts->engine_ops->name);
         return NULL;
     }
 
+    if (opts->poll_max_ns && !opts->engine_ops->supports_adaptive_polling) {
+        fprintf(stderr, "%s engine does not support poll-max-ns\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if (max_events_set && !opts->engine_ops->supports_max_events) {
+        fprintf(stderr, "%s engine does not support max-events\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if (num_workers_set && !opts->engine_ops->supports_num_workers) {
+        fprintf(stderr, "%s engine does not support num-workers\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if (opts->threads_pool_size &&
+        !opts->engine_ops->supports_threads_pool_size) {
+        fprintf(stderr, "%s engine does not support threads-pool-size\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if ((opts->io_uring_fixed || opts->io_uring_setup ||
+         opts->io_uring_sqpoll) &&
+        !opts->engine_ops->supports_io_uring_options) {
+        fprintf(stderr, "%s engine does not support io-uring-* options\n",
+                opts->engine_ops->name);
+        return false;
+    }
+
+    if ((opts->io_uring_sq_thread_cpu >= 0 ||
+         opts->io_uring_sq_thread_idle_ms) && !opts->io_uring_sqpoll) {
+        fprintf(stderr, "io-uring-sq-thread-* options require io-uring-sqpoll=1\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -205,27 +703,85 @@ struct engine **create_engines(const struct options *opts,
                                char **errmsg)
 {
     struct engine **engines;
+    int *shard_fds;
 
     engines = malloc(sizeof(engines[0]) * opts->num_engines);
-    if (!engines) {
+    shard_fds = malloc(sizeof(fds[0]) * opts->num_fds);
+    if (!engines || !shard_fds) {
+        free(engines);
+        free(shard_fds);
         *errmsg = strdup("Out of memory");
         return NULL;
     }
 
     for (int i = 0; i < opts->num_engines; i++) {
-        engines[i] = opts->engine_ops->create(opts, fds, errmsg);
+        int *engine_fds = fds;
+        int num_fds = opts->num_fds;
+
+        /* Deal fds round-robin so engine i gets fds i, i + n, i + 2n, ... */
+        if (opts->fd_distribution == FD_DISTRIBUTION_SHARDED) {
+            engine_fds = shard_fds;
+            num_fds = 0;
+            for (int j = i; j < opts->num_fds; j += opts->num_engines) {
+                shard_fds[num_fds++] = fds[j];
+            }
+        }
+
+        engines[i] = opts->engine_ops->create(opts, engine_fds, num_fds,
+                                              errmsg);
         if (!engines[i]) {
             while (i-- > 0) {
                 opts->engine_ops->destroy(engines[i]);
             }
             free(engines);
+            free(shard_fds);
             return NULL;
         }
     }
 
+    free(shard_fds);
     return engines;
 }
 
+/* Print service counters, which show how work was spread across engines */
+void print_engine_service_stats(struct engine **engines, int count)
+{
+    if (!engines[0]->ops->get_stats) {
+        return;
+    }
+
+    printf("Engine,Wakeups,Roundtrips/wakeup,Events,Reads,Spurious wakeups,Spurious wakeups (%%),Bytes echoed\n");
+    for (int i = 0; i < count; i++) {
+        struct engine *e = engines[i];
+        struct engine_stats stats;
+
+        e->ops->get_stats(e, &stats);
+        /* Each read that found data echoed one roundtrip's message */
+        printf("%d,%lu,%g,%lu,%lu,%lu,%g,%llu\n", i, stats.wakeups,
+               stats.wakeups ? (double)stats.reads / stats.wakeups : 0.0,
+               stats.events, stats.reads,
+               stats.spurious,
+               stats.events ? 100.0 * stats.spurious / stats.events : 0.0,
+               (unsigned long long)stats.bytes);
+    }
+}
+
+/* The generator has stopped so the engines are idle and counters are stable */
+void print_engine_stats(struct engine **engines,
+                        int count,
+                        unsigned long num_ios)
+{
+    print_engine_service_stats(engines, count);
+
+    for (int i = 0; i < count; i++) {
+        struct engine *e = engines[i];
+
+        if (e->ops->print_stats) {
+            e->ops->print_stats(e, i, num_ios);
+        }
+    }
+}
+
 void destroy_engines(struct engine **engines, int count)
 {
     for (int i = 0; i < count; i++) {
@@ -264,6 +820,8 @@ int main(int argc, char **argv)
         goto err;
     }
 
+    iogen_set_engines(&iogen, engines, opts.num_engines);
+
     set_signal_blocked(SIGALRM, false);
     alarm(opts.duration_secs);
 
@@ -271,6 +829,8 @@ int main(int argc, char **argv)
 
     alarm(0); /* in case iogen_run() returned early */
 
+    print_engine_stats(engines, opts.num_engines, iogen.num_ios);
+
     destroy_engines(engines, opts.num_engines);
     iogen_cleanup(&iogen);
     return EXIT_SUCCESS;
@@ -13,8 +13,17 @@ struct poll_engine {
     struct pollfd *pollfds;
     int num_fds;
     sem_t startup_semaphore;
+    struct adaptive_poll adaptive_poll;
+    struct engine_stats stats;
 };
 
+static int poll_wait(void *opaque, bool blocking)
+{
+    struct poll_engine *pe = opaque;
+
+    return poll(pe->pollfds, pe->num_fds, blocking ? -1 : 0);
+}
+
 static void *poll_thread(void *opaque)
 {
     struct poll_engine *pe = opaque;
@@ -25,7 +34,10 @@ static void *poll_thread(void *opaque)
     for (;;) {
         int ret;
 
-        ret = poll(pe->pollfds, pe->num_fds, -1);
+        ret = adaptive_poll_wait(&pe->adaptive_poll, poll_wait, pe);
+        if (ret > 0) {
+            pe->stats.wakeups++;
+        }
 
         for (int i = 0; ret > 0 && i < pe->num_fds; i++) {
             struct pollfd *pfd = &pe->pollfds[i];
@@ -47,10 +59,12 @@ static void *poll_thread(void *opaque)
                 return NULL;
             }
 
-            if (read(fd, pe->msgbuf, pe->msg_size) <= 0) {
+            pe->stats.events++;
+
+            if (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) <= 0) {
+                pe->stats.spurious++;
                 continue;
             }
-            write(fd, pe->msgbuf, pe->msg_size);
             ret--;
         }
     }
@@ -60,6 +74,7 @@ static void *poll_thread(void *opaque)
 
 static struct engine *poll_create(const struct options *opts,
                                   int *fds,
+                                  int num_fds,
                                   char **errmsg)
 {
     const char *err = NULL;
@@ -81,13 +96,13 @@ static struct engine *poll_create(const struct options *opts,
         goto err_free_se;
     }
 
-    pe->pollfds = calloc(opts->num_fds + 1, sizeof(pe->pollfds[0]));
+    pe->pollfds = calloc(num_fds + 1, sizeof(pe->pollfds[0]));
     if (!pe->pollfds) {
         err = "Out of memory";
         goto err_free_msgbuf;
     }
 
-    for (int i = 0; i < opts->num_fds; i++) {
+    for (int i = 0; i < num_fds; i++) {
         struct pollfd *pfd = &pe->pollfds[i + 1];
 
         pfd->fd = fds[i];
@@ -103,7 +118,10 @@ static struct engine *poll_create(const struct options *opts,
 
     pe->pollfds[0].events = POLLIN;
 
-    pe->num_fds = opts->num_fds + 1;
+    pe->num_fds = num_fds + 1;
+
+    adaptive_poll_init(&pe->adaptive_poll, opts->poll_max_ns);
+    memset(&pe->stats, 0, sizeof(pe->stats));
 
     /* The semaphore is used to wait for the thread to become ready */
     if (sem_init(&pe->startup_semaphore, 0, 0) < 0) {
@@ -161,8 +179,38 @@ static void poll_destroy(struct engine *e)
     free(pe);
 }
 
+static void poll_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct poll_engine *pe = (struct poll_engine *)e;
+
+    *stats = pe->stats;
+}
+
+static void poll_print_stats(struct engine *e,
+                             int index,
+                             __attribute__((unused)) unsigned long num_ios)
+{
+    struct poll_engine *pe = (struct poll_engine *)e;
+
+    if (!pe->adaptive_poll.poll_max_ns) {
+        return;
+    }
+
+    if (index == 0) {
+        printf("Engine");
+        adaptive_poll_print_header(&pe->adaptive_poll);
+        printf("\n");
+    }
+    printf("%d", index);
+    adaptive_poll_print_stats(&pe->adaptive_poll);
+    printf("\n");
+}
+
 const struct engine_ops poll_engine_ops = {
     .name = "poll",
     .create = poll_create,
     .destroy = poll_destroy,
+    .print_stats = poll_print_stats,
+    .get_stats = poll_get_stats,
+    .supports_adaptive_polling = true,
 };
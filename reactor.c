@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * A reactor thread waits for readiness with epoll and hands ready fds to a
+ * pool of worker threads that do the read(2) and write(2). Handoff goes
+ * through a bounded lock-free MPMC queue (Dmitry Vyukov's algorithm) and a
+ * semaphore that idle workers sleep on.
+ *
+ * Fds are registered with EPOLLONESHOT so each fd is in the queue at most
+ * once. The worker re-arms the fd after echoing the message.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "fdmonbench.h"
+
+struct reactor_cell {
+    atomic_size_t sequence;
+    int fd; /* -1 tells a worker to stop */
+    int64_t enqueue_ns;
+};
+
+/* Bounded MPMC queue, the size must be a power of 2 */
+struct reactor_queue {
+    struct reactor_cell *cells;
+    size_t mask;
+    atomic_size_t enqueue_pos __attribute__((aligned(64)));
+    atomic_size_t dequeue_pos __attribute__((aligned(64)));
+};
+
+struct reactor_worker {
+    struct reactor_engine *re;
+    pthread_t thread;
+    uint8_t *msgbuf;
+
+    /* Nanoseconds from enqueue to dequeue */
+    struct histogram handoff_ns;
+
+    /* Reads, spurious wakeups and bytes, events are counted by the reactor */
+    struct engine_stats stats;
+};
+
+struct reactor_engine {
+    struct engine engine;
+    pthread_t thread;
+    size_t msg_size;
+    sem_t startup_semaphore;
+    int efd; /* the eventfd */
+    int epfd; /* the epoll fd */
+    struct epoll_event *events;
+    int max_events;
+
+    struct reactor_queue queue;
+    sem_t queue_semaphore; /* number of queued items */
+
+    struct reactor_worker *workers;
+    int num_workers;
+
+    unsigned long num_wakeups;
+    unsigned long num_events;
+};
+
+static bool reactor_queue_init(struct reactor_queue *q, size_t size)
+{
+    q->cells = calloc(size, sizeof(q->cells[0]));
+    if (!q->cells) {
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&q->cells[i].sequence, i);
+    }
+
+    q->mask = size - 1;
+    atomic_init(&q->enqueue_pos, 0);
+    atomic_init(&q->dequeue_pos, 0);
+    return true;
+}
+
+static void reactor_queue_cleanup(struct reactor_queue *q)
+{
+    free(q->cells);
+}
+
+static bool reactor_queue_push(struct reactor_queue *q, int fd,
+                               int64_t enqueue_ns)
+{
+    struct reactor_cell *cell;
+    size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos,
+                                                      &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; /* full */
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->fd = fd;
+    cell->enqueue_ns = enqueue_ns;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool reactor_queue_pop(struct reactor_queue *q, int *fd,
+                              int64_t *enqueue_ns)
+{
+    struct reactor_cell *cell;
+    size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+
+    for (;;) {
+        size_t seq;
+        intptr_t diff;
+
+        cell = &q->cells[pos & q->mask];
+        seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos,
+                                                      &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false; /* empty */
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *fd = cell->fd;
+    *enqueue_ns = cell->enqueue_ns;
+    atomic_store_explicit(&cell->sequence, pos + q->mask + 1,
+                          memory_order_release);
+    return true;
+}
+
+/* Queue an item and wake a worker */
+static void reactor_dispatch(struct reactor_engine *re, int fd)
+{
+    /* Cannot fail, the queue has room for every fd and stop item */
+    reactor_queue_push(&re->queue, fd, get_ns());
+    sem_post(&re->queue_semaphore);
+}
+
+static void *reactor_worker_thread(void *opaque)
+{
+    struct reactor_worker *w = opaque;
+    struct reactor_engine *re = w->re;
+
+    /* Ready! */
+    sem_post(&re->startup_semaphore);
+
+    for (;;) {
+        struct epoll_event event;
+        int64_t enqueue_ns;
+        int fd;
+
+        if (sem_wait(&re->queue_semaphore) < 0) {
+            continue; /* EINTR */
+        }
+
+        /* The semaphore is posted after the push so the pop succeeds */
+        if (!reactor_queue_pop(&re->queue, &fd, &enqueue_ns)) {
+            continue;
+        }
+
+        /* Stop thread */
+        if (fd < 0) {
+            return NULL;
+        }
+
+        histogram_add(&w->handoff_ns, get_ns() - enqueue_ns);
+
+        if (engine_echo(&w->stats, fd, w->msgbuf, re->msg_size) <= 0) {
+            w->stats.spurious++;
+        }
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = fd;
+        epoll_ctl(re->epfd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    return NULL;
+}
+
+static void *reactor_thread(void *opaque)
+{
+    struct reactor_engine *re = opaque;
+
+    /* Ready! */
+    sem_post(&re->startup_semaphore);
+
+    for (;;) {
+        int ret;
+
+        ret = epoll_wait(re->epfd, re->events, re->max_events, -1);
+        if (ret > 0) {
+            re->num_wakeups++;
+        }
+
+        for (int i = 0; i < ret; i++) {
+            int fd = re->events[i].data.fd;
+
+            /* Handle our eventfd */
+            if (fd == re->efd) {
+                /* Stop workers and then this thread */
+                for (int j = 0; j < re->num_workers; j++) {
+                    reactor_dispatch(re, -1);
+                }
+                return NULL;
+            }
+
+            re->num_events++;
+            reactor_dispatch(re, fd);
+        }
+    }
+
+    return NULL;
+}
+
+/* Wait for a thread to become ready */
+static bool reactor_wait_startup(struct reactor_engine *re)
+{
+    int ret;
+
+    do {
+        ret = sem_wait(&re->startup_semaphore);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == 0;
+}
+
+static struct engine *reactor_create(const struct options *opts,
+                                     int *fds,
+                                     int num_fds,
+                                     char **errmsg)
+{
+    const char *err = NULL;
+    struct reactor_engine *re;
+    struct epoll_event event = {
+        .events = EPOLLIN,
+    };
+    uint64_t eventfd_val = 1;
+    size_t queue_size = 1;
+    int num_started = 0;
+
+    /* The queue positions are cacheline aligned to avoid false sharing */
+    re = aligned_alloc(__alignof__(*re), sizeof(*re));
+    if (!re) {
+        *errmsg = strdup("Out of memory");
+        return NULL;
+    }
+
+    re->engine.ops = &reactor_engine_ops;
+    re->msg_size = opts->msg_size;
+    re->num_workers = opts->num_workers;
+    re->num_wakeups = 0;
+    re->num_events = 0;
+
+    re->max_events = opts->max_events;
+    re->events = malloc(sizeof(re->events[0]) * re->max_events);
+    if (!re->events) {
+        err = "Out of memory";
+        goto err_free_re;
+    }
+
+    /* Room for every fd plus a stop item for each worker */
+    while (queue_size < (size_t)num_fds + re->num_workers) {
+        queue_size *= 2;
+    }
+
+    if (!reactor_queue_init(&re->queue, queue_size)) {
+        err = "Out of memory";
+        goto err_free_events;
+    }
+
+    re->workers = calloc(re->num_workers, sizeof(re->workers[0]));
+    if (!re->workers) {
+        err = "Out of memory";
+        goto err_queue_cleanup;
+    }
+
+    for (int i = 0; i < re->num_workers; i++) {
+        struct reactor_worker *w = &re->workers[i];
+
+        w->re = re;
+        histogram_init(&w->handoff_ns);
+
+        w->msgbuf = calloc(1, opts->msg_size);
+        if (!w->msgbuf) {
+            err = "Out of memory";
+            goto err_free_workers;
+        }
+    }
+
+    re->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (re->epfd < 0) {
+        err = "epoll_create1 failed";
+        goto err_free_workers;
+    }
+
+    /* The eventfd is used to tell the thread to stop */
+    re->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (re->efd < 0) {
+        err = "Eventfd creation failed";
+        goto err_close_epfd;
+    }
+
+    event.data.fd = re->efd;
+    if (epoll_ctl(re->epfd, EPOLL_CTL_ADD, re->efd, &event) < 0) {
+        err = "epoll_ctl failed";
+        goto err_close_efd;
+    }
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    for (int i = 0; i < num_fds; i++) {
+        event.data.fd = fds[i];
+
+        if (epoll_ctl(re->epfd, EPOLL_CTL_ADD, fds[i], &event) < 0) {
+            err = "epoll_ctl failed";
+            goto err_close_efd;
+        }
+    }
+
+    if (sem_init(&re->queue_semaphore, 0, 0) < 0) {
+        err = "Failed to create queue semaphore";
+        goto err_close_efd;
+    }
+
+    /* The semaphore is used to wait for the threads to become ready */
+    if (sem_init(&re->startup_semaphore, 0, 0) < 0) {
+        err = "Failed to create startup semaphore";
+        goto err_queue_sem_destroy;
+    }
+
+    /* Start workers */
+    for (int i = 0; i < re->num_workers; i++) {
+        struct reactor_worker *w = &re->workers[i];
+
+        if (pthread_create(&w->thread, NULL, reactor_worker_thread, w) != 0) {
+            err = "pthread_create failed";
+            goto err_stop_workers;
+        }
+        num_started++;
+
+        if (!reactor_wait_startup(re)) {
+            err = "sem_wait failed";
+            goto err_stop_workers;
+        }
+    }
+
+    /* Start reactor thread */
+    if (pthread_create(&re->thread, NULL, reactor_thread, re) != 0) {
+        err = "pthread_create failed";
+        goto err_stop_workers;
+    }
+
+    if (!reactor_wait_startup(re)) {
+        err = "sem_wait failed";
+        goto err_pthread_join;
+    }
+
+    return &re->engine;
+
+err_pthread_join:
+    /* The reactor thread stops the workers before exiting */
+    write(re->efd, &eventfd_val, sizeof(eventfd_val));
+    pthread_join(re->thread, NULL);
+    goto err_join_workers;
+err_stop_workers:
+    for (int i = 0; i < num_started; i++) {
+        reactor_dispatch(re, -1);
+    }
+err_join_workers:
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(re->workers[i].thread, NULL);
+    }
+    sem_destroy(&re->startup_semaphore);
+err_queue_sem_destroy:
+    sem_destroy(&re->queue_semaphore);
+err_close_efd:
+    close(re->efd);
+err_close_epfd:
+    close(re->epfd);
+err_free_workers:
+    for (int i = 0; i < re->num_workers; i++) {
+        free(re->workers[i].msgbuf);
+    }
+    free(re->workers);
+err_queue_cleanup:
+    reactor_queue_cleanup(&re->queue);
+err_free_events:
+    free(re->events);
+err_free_re:
+    free(re);
+    *errmsg = strdup(err);
+    return NULL;
+}
+
+static void reactor_destroy(struct engine *e)
+{
+    struct reactor_engine *re = (struct reactor_engine *)e;
+    uint64_t eventfd_val = 1;
+
+    /* The reactor thread stops the workers before exiting */
+    write(re->efd, &eventfd_val, sizeof(eventfd_val));
+    pthread_join(re->thread, NULL);
+
+    for (int i = 0; i < re->num_workers; i++) {
+        pthread_join(re->workers[i].thread, NULL);
+        free(re->workers[i].msgbuf);
+    }
+
+    sem_destroy(&re->startup_semaphore);
+    sem_destroy(&re->queue_semaphore);
+
+    close(re->efd);
+    close(re->epfd);
+    free(re->workers);
+    reactor_queue_cleanup(&re->queue);
+    free(re->events);
+    free(re);
+}
+
+static void reactor_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct reactor_engine *re = (struct reactor_engine *)e;
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < re->num_workers; i++) {
+        engine_stats_add(stats, &re->workers[i].stats);
+    }
+    stats->wakeups = re->num_wakeups;
+    stats->events = re->num_events;
+}
+
+static void reactor_print_stats(struct engine *e,
+                                int index,
+                                unsigned long num_ios)
+{
+    struct reactor_engine *re = (struct reactor_engine *)e;
+    struct histogram h;
+
+    histogram_init(&h);
+    for (int i = 0; i < re->num_workers; i++) {
+        histogram_merge(&h, &re->workers[i].handoff_ns);
+    }
+
+    if (index == 0) {
+        printf("Engine,Workers,Handoffs,Handoffs/roundtrip,Handoff ns,Handoff ns p50,Handoff ns p99,Handoff ns max\n");
+    }
+    printf("%d,%d,%lu,%g,%g,%lu,%lu,%lu\n", index, re->num_workers,
+           (unsigned long)h.total,
+           (double)h.total / num_ios,
+           histogram_mean(&h),
+           (unsigned long)histogram_percentile(&h, 50),
+           (unsigned long)histogram_percentile(&h, 99),
+           (unsigned long)h.max);
+}
+
+const struct engine_ops reactor_engine_ops = {
+    .name = "reactor",
+    .create = reactor_create,
+    .destroy = reactor_destroy,
+    .print_stats = reactor_print_stats,
+    .get_stats = reactor_get_stats,
+    .supports_max_events = true,
+    .supports_num_workers = true,
+};
@@ -12,21 +12,39 @@ struct select_engine {
     size_t msg_size;
     int *fds;
     int num_fds;
+    int nfds;
+    fd_set readfds;
     sem_t startup_semaphore;
+    struct adaptive_poll adaptive_poll;
+    struct engine_stats stats;
 };
 
+static int select_wait(void *opaque, bool blocking)
+{
+    struct select_engine *se = opaque;
+    struct timeval timeout = {0};
+
+    /* Initialize readfds */
+    FD_ZERO(&se->readfds);
+    for (int i = 0; i < se->num_fds; i++) {
+        FD_SET(se->fds[i], &se->readfds);
+    }
+
+    return select(se->nfds, &se->readfds, NULL, NULL,
+                  blocking ? NULL : &timeout);
+}
+
 static void *select_thread(void *opaque)
 {
     struct select_engine *se = opaque;
-    fd_set readfds;
-    int nfds = 0;
     int ret;
     int i;
 
     /* Calculate nfds */
+    se->nfds = 0;
     for (i = 0; i < se->num_fds; i++) {
-        if (se->fds[i] + 1 > nfds) {
-            nfds = se->fds[i] + 1;
+        if (se->fds[i] + 1 > se->nfds) {
+            se->nfds = se->fds[i] + 1;
         }
     }
 
@@ -34,18 +52,15 @@ static void *select_thread(void *opaque)
     sem_post(&se->startup_semaphore);
 
     for (;;) {
-        /* Initialize readfds */
-        FD_ZERO(&readfds);
-        for (i = 0; i < se->num_fds; i++) {
-            FD_SET(se->fds[i], &readfds);
+        ret = adaptive_poll_wait(&se->adaptive_poll, select_wait, se);
+        if (ret > 0) {
+            se->stats.wakeups++;
         }
 
-        ret = select(nfds, &readfds, NULL, NULL, NULL);
-
         for (i = 0; ret > 0 && i < se->num_fds; i++) {
             int fd = se->fds[i];
 
-            if (!FD_ISSET(fd, &readfds)) {
+            if (!FD_ISSET(fd, &se->readfds)) {
                 continue;
             }
 
@@ -61,10 +76,12 @@ static void *select_thread(void *opaque)
                 return NULL;
             }
 
-            if (read(fd, se->msgbuf, se->msg_size) <= 0) {
+            se->stats.events++;
+
+            if (engine_echo(&se->stats, fd, se->msgbuf, se->msg_size) <= 0) {
+                se->stats.spurious++;
                 continue;
             }
-            write(fd, se->msgbuf, se->msg_size);
             ret--;
         }
     }
@@ -74,13 +91,14 @@ static void *select_thread(void *opaque)
 
 static struct engine *select_create(const struct options *opts,
                                     int *fds,
+                                    int num_fds,
                                     char **errmsg)
 {
     const char *err = NULL;
     struct select_engine *se;
     int ret;
 
-    for (int i = 0; i < opts->num_fds; i++) {
+    for (int i = 0; i < num_fds; i++) {
         if (fds[i] >= FD_SETSIZE) {
             *errmsg = strdup("Maximum number of fds exceeded for select engine");
             return NULL;
@@ -102,12 +120,12 @@ static struct engine *select_create(const struct options *opts,
         goto err_free_se;
     }
 
-    se->fds = malloc(sizeof(fds[0]) * (opts->num_fds + 1));
+    se->fds = malloc(sizeof(fds[0]) * (num_fds + 1));
     if (!se->fds) {
         err = "Out of memory";
         goto err_free_msgbuf;
     }
-    memcpy(&se->fds[1], fds, sizeof(fds[0]) * opts->num_fds);
+    memcpy(&se->fds[1], fds, sizeof(fds[0]) * num_fds);
 
     /* The eventfd is used to tell the thread to stop */
     se->fds[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
@@ -120,7 +138,10 @@ static struct engine *select_create(const struct options *opts,
         goto err_close_eventfd;
     }
 
-    se->num_fds = opts->num_fds + 1;
+    se->num_fds = num_fds + 1;
+
+    adaptive_poll_init(&se->adaptive_poll, opts->poll_max_ns);
+    memset(&se->stats, 0, sizeof(se->stats));
 
     /* The semaphore is used to wait for the thread to become ready */
     if (sem_init(&se->startup_semaphore, 0, 0) < 0) {
@@ -178,8 +199,38 @@ static void select_destroy(struct engine *e)
     free(se);
 }
 
+static void select_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct select_engine *se = (struct select_engine *)e;
+
+    *stats = se->stats;
+}
+
+static void select_print_stats(struct engine *e,
+                               int index,
+                               __attribute__((unused)) unsigned long num_ios)
+{
+    struct select_engine *se = (struct select_engine *)e;
+
+    if (!se->adaptive_poll.poll_max_ns) {
+        return;
+    }
+
+    if (index == 0) {
+        printf("Engine");
+        adaptive_poll_print_header(&se->adaptive_poll);
+        printf("\n");
+    }
+    printf("%d", index);
+    adaptive_poll_print_stats(&se->adaptive_poll);
+    printf("\n");
+}
+
 const struct engine_ops select_engine_ops = {
     .name = "select",
     .create = select_create,
     .destroy = select_destroy,
+    .print_stats = select_print_stats,
+    .get_stats = select_get_stats,
+    .supports_adaptive_polling = true,
 };
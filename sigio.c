@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Signal-driven I/O. Each fd has O_ASYNC set and sends a realtime signal with
+ * si_fd to the engine thread when it becomes readable. The thread blocks the
+ * signal and collects it in batches through a signalfd, so there is no
+ * registration set to maintain at all.
+ *
+ * When the realtime signal queue overflows the kernel sends a plain SIGIO
+ * instead and the fd is lost, so all fds are rescanned in that case.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+#include "fdmonbench.h"
+
+/* Maximum number of signals read from the signalfd at once */
+#define SIGIO_BATCH_SIZE 64
+
+struct sigio_engine {
+    struct engine engine;
+    pthread_t thread;
+    pid_t tid; /* the engine thread's tid for F_SETOWN_EX */
+    uint8_t *msgbuf;
+    size_t msg_size;
+    int *fds;
+    int num_fds;
+    int sfd; /* the signalfd */
+    int signo; /* the realtime signal number */
+    sem_t startup_semaphore;
+
+    /* Statistics */
+    unsigned long num_signals;
+    unsigned long num_rescans;
+    struct histogram signals_per_wait;
+    struct engine_stats stats;
+};
+
+/* Echo everything queued on an fd, returns false if there was nothing */
+static bool sigio_drain_fd(struct sigio_engine *pe, int fd)
+{
+    if (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) <= 0) {
+        return false;
+    }
+
+    while (engine_echo(&pe->stats, fd, pe->msgbuf, pe->msg_size) > 0) {
+        /* nothing */
+    }
+    return true;
+}
+
+static void *sigio_thread(void *opaque)
+{
+    struct sigio_engine *pe = opaque;
+    struct signalfd_siginfo infos[SIGIO_BATCH_SIZE];
+    sigset_t mask;
+
+    /* Signals are only received through the signalfd */
+    sigemptyset(&mask);
+    sigaddset(&mask, pe->signo);
+    sigaddset(&mask, SIGIO);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pe->tid = gettid();
+
+    /* Ready! */
+    sem_post(&pe->startup_semaphore);
+
+    for (;;) {
+        ssize_t ret;
+        int n;
+
+        ret = read(pe->sfd, infos, sizeof(infos));
+        if (ret < (ssize_t)sizeof(infos[0])) {
+            continue;
+        }
+
+        n = ret / sizeof(infos[0]);
+        histogram_add(&pe->signals_per_wait, n);
+        pe->stats.wakeups++;
+        pe->num_signals += n;
+
+        for (int i = 0; i < n; i++) {
+            struct signalfd_siginfo *info = &infos[i];
+
+            /* The signal queue overflowed, look at every fd */
+            if (info->ssi_signo == SIGIO) {
+                pe->num_rescans++;
+
+                for (int j = 0; j < pe->num_fds; j++) {
+                    sigio_drain_fd(pe, pe->fds[j]);
+                }
+                continue;
+            }
+
+            /* Stop thread */
+            if (info->ssi_code == SI_QUEUE) {
+                return NULL;
+            }
+
+            pe->stats.events++;
+
+            if (!sigio_drain_fd(pe, info->ssi_fd)) {
+                pe->stats.spurious++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Tell the thread to stop with a signal that carries no fd */
+static void sigio_stop_thread(struct sigio_engine *pe)
+{
+    pthread_sigqueue(pe->thread, pe->signo, (union sigval){0});
+    pthread_join(pe->thread, NULL);
+}
+
+static void sigio_clear_async(struct sigio_engine *pe, int count)
+{
+    for (int i = 0; i < count; i++) {
+        int fd = pe->fds[i];
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_ASYNC);
+    }
+}
+
+static struct engine *sigio_create(const struct options *opts,
+                                   int *fds,
+                                   int num_fds,
+                                   char **errmsg)
+{
+    const char *err = NULL;
+    struct sigio_engine *pe;
+    sigset_t mask;
+    int ret;
+    int i;
+
+    /* An fd can only deliver signals to one owner */
+    if (opts->num_engines > 1 &&
+        opts->fd_distribution == FD_DISTRIBUTION_SHARED) {
+        *errmsg = strdup("sigio engine needs fd-distribution=sharded with num-engines > 1");
+        return NULL;
+    }
+
+    pe = malloc(sizeof(*pe));
+    if (!pe) {
+        *errmsg = strdup("Out of memory");
+        return NULL;
+    }
+
+    pe->engine.ops = &sigio_engine_ops;
+    pe->signo = SIGRTMIN;
+    pe->num_signals = 0;
+    pe->num_rescans = 0;
+    histogram_init(&pe->signals_per_wait);
+    memset(&pe->stats, 0, sizeof(pe->stats));
+
+    pe->msg_size = opts->msg_size;
+    pe->msgbuf = calloc(1, opts->msg_size);
+    if (!pe->msgbuf) {
+        err = "Out of memory";
+        goto err_free_pe;
+    }
+
+    pe->fds = malloc(sizeof(fds[0]) * num_fds);
+    if (!pe->fds) {
+        err = "Out of memory";
+        goto err_free_msgbuf;
+    }
+    memcpy(pe->fds, fds, sizeof(fds[0]) * num_fds);
+    pe->num_fds = num_fds;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, pe->signo);
+    sigaddset(&mask, SIGIO);
+
+    pe->sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (pe->sfd < 0) {
+        err = "signalfd failed";
+        goto err_free_fds;
+    }
+
+    /* The semaphore is used to wait for the thread to become ready */
+    if (sem_init(&pe->startup_semaphore, 0, 0) < 0) {
+        err = "Failed to create startup semaphore";
+        goto err_close_sfd;
+    }
+
+    /* Start thread */
+    if (pthread_create(&pe->thread, NULL, sigio_thread, pe) != 0) {
+        err = "pthread_create failed";
+        goto err_sem_destroy;
+    }
+
+    /* Wait for thread to become ready */
+    do {
+        ret = sem_wait(&pe->startup_semaphore);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret < 0) {
+        err = "sem_wait failed";
+        goto err_stop_thread;
+    }
+
+    /* Now that the thread has blocked the signal, direct fd signals to it */
+    for (i = 0; i < pe->num_fds; i++) {
+        struct f_owner_ex owner = {
+            .type = F_OWNER_TID,
+            .pid = pe->tid,
+        };
+        int fd = pe->fds[i];
+
+        if (fcntl(fd, F_SETOWN_EX, &owner) < 0 ||
+            fcntl(fd, F_SETSIG, pe->signo) < 0 ||
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_ASYNC) < 0) {
+            err = "Failed to enable O_ASYNC";
+            goto err_clear_async;
+        }
+    }
+
+    /* Messages that arrived before O_ASYNC was set raised no signal */
+    pthread_sigqueue(pe->thread, SIGIO, (union sigval){0});
+
+    return &pe->engine;
+
+err_clear_async:
+    sigio_clear_async(pe, i);
+err_stop_thread:
+    sigio_stop_thread(pe);
+err_sem_destroy:
+    sem_destroy(&pe->startup_semaphore);
+err_close_sfd:
+    close(pe->sfd);
+err_free_fds:
+    free(pe->fds);
+err_free_msgbuf:
+    free(pe->msgbuf);
+err_free_pe:
+    free(pe);
+    *errmsg = strdup(err);
+    return NULL;
+}
+
+static void sigio_destroy(struct engine *e)
+{
+    struct sigio_engine *pe = (struct sigio_engine *)e;
+
+    sigio_clear_async(pe, pe->num_fds);
+    sigio_stop_thread(pe);
+
+    sem_destroy(&pe->startup_semaphore);
+
+    close(pe->sfd);
+    free(pe->fds);
+    free(pe->msgbuf);
+    free(pe);
+}
+
+static void sigio_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct sigio_engine *pe = (struct sigio_engine *)e;
+
+    *stats = pe->stats;
+}
+
+static void sigio_print_stats(struct engine *e,
+                              int index,
+                              unsigned long num_ios)
+{
+    struct sigio_engine *pe = (struct sigio_engine *)e;
+    struct histogram *h = &pe->signals_per_wait;
+
+    if (index == 0) {
+        printf("Engine,Signals,Signals/roundtrip,Rescans,Signals/wait,Signals/wait p50,Signals/wait p99,Signals/wait max\n");
+    }
+    printf("%d,%lu,%g,%lu,%g,%lu,%lu,%lu\n", index, pe->num_signals,
+           (double)pe->num_signals / num_ios,
+           pe->num_rescans,
+           histogram_mean(h),
+           (unsigned long)histogram_percentile(h, 50),
+           (unsigned long)histogram_percentile(h, 99),
+           (unsigned long)h->max);
+}
+
+const struct engine_ops sigio_engine_ops = {
+    .name = "sigio",
+    .create = sigio_create,
+    .destroy = sigio_destroy,
+    .print_stats = sigio_print_stats,
+    .get_stats = sigio_get_stats,
+};
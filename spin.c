@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Busy-wait on all fds with non-blocking read(2) and never sleep. This is the
+ * zero-wakeup baseline: it pays the syscall cost of reading each message but
+ * never the cost of blocking and being woken up.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include "fdmonbench.h"
+
+struct spin_engine {
+    struct engine engine;
+    pthread_t thread;
+    uint8_t *msgbuf;
+    size_t msg_size;
+    int *fds;
+    int num_fds;
+    volatile bool stop;
+    bool stopped; /* has the thread been joined? */
+    sem_t startup_semaphore;
+
+    /* Number of read(2) calls that found no data */
+    unsigned long num_empty_polls;
+    struct engine_stats stats;
+};
+
+static void *spin_thread(void *opaque)
+{
+    struct spin_engine *se = opaque;
+
+    /* Ready! */
+    sem_post(&se->startup_semaphore);
+
+    while (!se->stop) {
+        for (int i = 0; i < se->num_fds; i++) {
+            /* The engine fds are non-blocking */
+            if (engine_echo(&se->stats, se->fds[i], se->msgbuf,
+                            se->msg_size) <= 0) {
+                se->num_empty_polls++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static struct engine *spin_create(const struct options *opts,
+                                  int *fds,
+                                  int num_fds,
+                                  char **errmsg)
+{
+    const char *err = NULL;
+    struct spin_engine *se;
+    int ret;
+
+    se = malloc(sizeof(*se));
+    if (!se) {
+        *errmsg = strdup("Out of memory");
+        return NULL;
+    }
+
+    se->engine.ops = &spin_engine_ops;
+    se->stop = false;
+    se->stopped = false;
+    se->num_empty_polls = 0;
+    memset(&se->stats, 0, sizeof(se->stats));
+
+    se->msg_size = opts->msg_size;
+    se->msgbuf = calloc(1, opts->msg_size);
+    if (!se->msgbuf) {
+        err = "Out of memory";
+        goto err_free_se;
+    }
+
+    se->fds = malloc(sizeof(fds[0]) * num_fds);
+    if (!se->fds) {
+        err = "Out of memory";
+        goto err_free_msgbuf;
+    }
+    memcpy(se->fds, fds, sizeof(fds[0]) * num_fds);
+    se->num_fds = num_fds;
+
+    /* The semaphore is used to wait for the thread to become ready */
+    if (sem_init(&se->startup_semaphore, 0, 0) < 0) {
+        err = "Failed to create startup semaphore";
+        goto err_free_fds;
+    }
+
+    /* Start thread */
+    if (pthread_create(&se->thread, NULL, spin_thread, se) != 0) {
+        err = "pthread_create failed";
+        goto err_sem_destroy;
+    }
+
+    /* Wait for thread to become ready */
+    do {
+        ret = sem_wait(&se->startup_semaphore);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret < 0) {
+        err = "sem_wait failed";
+        goto err_pthread_join;
+    }
+
+    return &se->engine;
+
+err_pthread_join:
+    se->stop = true;
+    pthread_join(se->thread, NULL);
+err_sem_destroy:
+    sem_destroy(&se->startup_semaphore);
+err_free_fds:
+    free(se->fds);
+err_free_msgbuf:
+    free(se->msgbuf);
+err_free_se:
+    free(se);
+    *errmsg = strdup(err);
+    return NULL;
+}
+
+/*
+ * The thread never goes idle, so stop it before reading its counters. Spins
+ * after the generator stopped are not counted then either.
+ */
+static void spin_stop_thread(struct spin_engine *se)
+{
+    if (!se->stopped) {
+        se->stop = true;
+        pthread_join(se->thread, NULL);
+        se->stopped = true;
+    }
+}
+
+static void spin_destroy(struct engine *e)
+{
+    struct spin_engine *se = (struct spin_engine *)e;
+
+    spin_stop_thread(se);
+
+    sem_destroy(&se->startup_semaphore);
+
+    free(se->fds);
+    free(se->msgbuf);
+    free(se);
+}
+
+static void spin_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct spin_engine *se = (struct spin_engine *)e;
+
+    spin_stop_thread(se);
+    *stats = se->stats;
+}
+
+static void spin_print_stats(struct engine *e,
+                             int index,
+                             unsigned long num_ios)
+{
+    struct spin_engine *se = (struct spin_engine *)e;
+
+    spin_stop_thread(se);
+
+    if (index == 0) {
+        printf("Engine,Empty polls,Empty polls/roundtrip\n");
+    }
+    printf("%d,%lu,%g\n", index, se->num_empty_polls,
+           (double)se->num_empty_polls / num_ios);
+}
+
+const struct engine_ops spin_engine_ops = {
+    .name = "spin",
+    .create = spin_create,
+    .destroy = spin_destroy,
+    .print_stats = spin_print_stats,
+    .get_stats = spin_get_stats,
+};
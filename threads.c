@@ -2,35 +2,82 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include "fdmonbench.h"
 
 struct threads_engine {
     struct engine engine;
     pthread_t *threads;
-    uint8_t *msgbuf;
+    uint8_t *msgbuf; /* one message buffer per thread */
     size_t msg_size;
     sem_t startup_semaphore;
     int startup_fd;
+    int startup_index;
     int num_fds;
+    int num_threads;
+    int epfd; /* the worker pool's epoll fd, or -1 with one thread per fd */
+    struct engine_stats *thread_stats; /* one per thread */
 };
 
 static void *threads_fd_thread(void *opaque)
 {
     struct threads_engine *te = opaque;
+    struct engine_stats *stats = &te->thread_stats[te->startup_index];
+    uint8_t *msgbuf = te->msgbuf + te->startup_index * te->msg_size;
     int fd = te->startup_fd;
 
     /* Ready! */
     sem_post(&te->startup_semaphore);
 
+    /*
+     * Each return from the blocking read(2) counts as an event. Count it
+     * afterwards so a thread parked in read(2) has not counted a wakeup yet.
+     */
     for (;;) {
-        ssize_t ret;
+        ssize_t len = engine_echo(stats, fd, msgbuf, te->msg_size);
 
-        ret = read(fd, te->msgbuf, te->msg_size);
-        if (ret != (ssize_t)te->msg_size) {
+        stats->wakeups++;
+        stats->events++;
+        if (len <= 0) {
+            stats->spurious++;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Pool workers share one epoll set. EPOLLONESHOT hands each ready fd to a
+ * single worker, which does blocking I/O and then re-arms the fd.
+ */
+static void *threads_pool_thread(void *opaque)
+{
+    struct threads_engine *te = opaque;
+    struct engine_stats *stats = &te->thread_stats[te->startup_index];
+    uint8_t *msgbuf = te->msgbuf + te->startup_index * te->msg_size;
+
+    /* Ready! */
+    sem_post(&te->startup_semaphore);
+
+    for (;;) {
+        struct epoll_event event;
+        int fd;
+
+        if (epoll_wait(te->epfd, &event, 1, -1) != 1) {
             continue;
         }
-        write(fd, te->msgbuf, te->msg_size);
+
+        fd = event.data.fd;
+
+        if (engine_echo(stats, fd, msgbuf, te->msg_size) <= 0) {
+            stats->spurious++;
+        }
+        stats->wakeups++;
+        stats->events++;
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        epoll_ctl(te->epfd, EPOLL_CTL_MOD, fd, &event);
     }
 
     return NULL;
@@ -38,6 +85,7 @@ static void *threads_fd_thread(void *opaque)
 
 static struct engine *threads_create(const struct options *opts,
                                      int *fds,
+                                     int num_fds,
                                      char **errmsg)
 {
     const char *err = NULL;
@@ -51,36 +99,74 @@ static struct engine *threads_create(const struct options *opts,
     }
 
     te->engine.ops = &threads_engine_ops;
-    te->num_fds = opts->num_fds;
+    te->num_fds = num_fds;
+    te->num_threads = opts->threads_pool_size ?
+                      opts->threads_pool_size : num_fds;
+    te->epfd = -1;
 
     te->msg_size = opts->msg_size;
-    te->msgbuf = calloc(1, opts->msg_size);
+    te->msgbuf = calloc(te->num_threads, opts->msg_size);
     if (!te->msgbuf) {
         err = "Out of memory";
         goto err_free_se;
     }
 
-    te->threads = malloc(sizeof(te->threads[0]) * te->num_fds);
+    te->threads = malloc(sizeof(te->threads[0]) * te->num_threads);
     if (!te->threads) {
         err = "Out of memory";
         goto err_free_msgbuf;
     }
 
-    /* The semaphore is used to wait for the thread to become ready */
-    if (sem_init(&te->startup_semaphore, 0, 0) < 0) {
-        err = "Failed to create startup semaphore";
+    te->thread_stats = calloc(te->num_threads, sizeof(te->thread_stats[0]));
+    if (!te->thread_stats) {
+        err = "Out of memory";
         goto err_free_threads;
     }
 
-    for (int i = 0; i < te->num_fds; i++) {
-        te->startup_fd = fds[i]; /* stash it for the thread */
+    if (opts->threads_pool_size) {
+        te->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (te->epfd < 0) {
+            err = "epoll_create1 failed";
+            goto err_free_thread_stats;
+        }
+
+        for (int i = 0; i < te->num_fds; i++) {
+            struct epoll_event event = {
+                .events = EPOLLIN | EPOLLONESHOT,
+                .data.fd = fds[i],
+            };
+
+            if (epoll_ctl(te->epfd, EPOLL_CTL_ADD, fds[i], &event) < 0) {
+                err = "epoll_ctl failed";
+                goto err_close_epfd;
+            }
+        }
+    }
 
-        /* The thread does blocking I/O */
+    /* Threads do blocking I/O */
+    for (int i = 0; i < te->num_fds; i++) {
         fcntl(fds[i], F_SETFL,
               fcntl(fds[i], F_GETFL, 0) & ~O_NONBLOCK);
+    }
+
+    /* The semaphore is used to wait for the thread to become ready */
+    if (sem_init(&te->startup_semaphore, 0, 0) < 0) {
+        err = "Failed to create startup semaphore";
+        goto err_close_epfd;
+    }
+
+    for (int i = 0; i < te->num_threads; i++) {
+        void *(*fn)(void *) = threads_fd_thread;
+
+        te->startup_index = i;
+        if (te->epfd >= 0) {
+            fn = threads_pool_thread;
+        } else {
+            te->startup_fd = fds[i]; /* stash it for the thread */
+        }
 
         /* Start thread */
-        if (pthread_create(&te->threads[i], NULL, threads_fd_thread, te) != 0) {
+        if (pthread_create(&te->threads[i], NULL, fn, te) != 0) {
             err = "pthread_create failed";
 err_cancel_threads:
             while (i-- > 0) {
@@ -106,6 +192,12 @@ err_cancel_threads:
 
 err_sem_destroy:
     sem_destroy(&te->startup_semaphore);
+err_close_epfd:
+    if (te->epfd >= 0) {
+        close(te->epfd);
+    }
+err_free_thread_stats:
+    free(te->thread_stats);
 err_free_threads:
     free(te->threads);
 err_free_msgbuf:
@@ -120,20 +212,59 @@ static void threads_destroy(struct engine *e)
 {
     struct threads_engine *te = (struct threads_engine *)e;
 
-    for (int i = 0; i < te->num_fds; i++) {
+    for (int i = 0; i < te->num_threads; i++) {
         pthread_cancel(te->threads[i]);
         pthread_join(te->threads[i], NULL);
     }
 
     sem_destroy(&te->startup_semaphore);
 
+    if (te->epfd >= 0) {
+        close(te->epfd);
+    }
+
+    free(te->thread_stats);
     free(te->threads);
     free(te->msgbuf);
     free(te);
 }
 
+static void threads_get_stats(struct engine *e, struct engine_stats *stats)
+{
+    struct threads_engine *te = (struct threads_engine *)e;
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < te->num_threads; i++) {
+        engine_stats_add(stats, &te->thread_stats[i]);
+    }
+}
+
+static void threads_print_stats(struct engine *e,
+                                int index,
+                                __attribute__((unused)) unsigned long num_ios)
+{
+    struct threads_engine *te = (struct threads_engine *)e;
+    size_t stack_size = 0;
+    pthread_attr_t attr;
+
+    /* Threads were created with the default attributes */
+    if (pthread_getattr_default_np(&attr) == 0) {
+        pthread_attr_getstacksize(&attr, &stack_size);
+        pthread_attr_destroy(&attr);
+    }
+
+    if (index == 0) {
+        printf("Engine,Threads,Stack memory (KiB)\n");
+    }
+    printf("%d,%d,%zu\n", index, te->num_threads,
+           te->num_threads * stack_size / 1024);
+}
+
 const struct engine_ops threads_engine_ops = {
     .name = "threads",
     .create = threads_create,
     .destroy = threads_destroy,
+    .print_stats = threads_print_stats,
+    .get_stats = threads_get_stats,
+    .supports_threads_pool_size = true,
 };